@@ -33,8 +33,24 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <time.h>
+#include <string.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include "config.h"
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 #ifdef KGTK_DEBUG
 static int kgtkDebug = 0;
 #endif
@@ -129,69 +145,398 @@ static const char *getSockName()
     return sock;
 }
 
-static int readBlock(int fd, char *pData, int size)
+#if defined(__linux__) && defined(SO_PEERCRED) && defined(HAVE_STRUCT_UCRED)
+/*
+    On Linux kdialogd listens on an abstract socket, keyed on user and display. This needs no files - so there
+    is nothing to stat, or to clean up - and the connection itself shows whether kdialogd is still running.
+    Abstract sockets have no permissions, so both sides check the uid of their peer via SO_PEERCRED. The
+    filesystem socket, and pid file, are only used if this fails.
+*/
+#define KGTK_ABSTRACT_SOCKET
+#define ABSTRACT_SOCK_NAME "kgtk-kdialogd"
+
+/* Fill in 'addr' with the abstract address for this user and display, and return its length */
+static socklen_t getAbstractSockAddr(struct sockaddr_un *addr)
 {
-    int bytesToRead = size;
+    const char *display = getenv("DISPLAY");
+    int        len;
 
-    do {
-        fd_set fdSet;
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    /* sun_path[0] is left as 0 - which is what makes this an abstract address */
+    len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "%s-%u-%s", ABSTRACT_SOCK_NAME,
+                   (unsigned int)getuid(), display ? display : "");
+
+    if (len < 0 || len > (int)sizeof(addr->sun_path) - 2) {
+        len = sizeof(addr->sun_path) - 2;
+    }
 
-        FD_ZERO(&fdSet);
-        FD_SET(fd, &fdSet);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
 
-        if (select(fd + 1, &fdSet, NULL, NULL, NULL) < 0) {
+/* Returns 1 if the process at the other end of 'fd' is running as us, and sets 'pid' to its pid */
+static int peerIsUs(int fd, pid_t *pid)
+{
+    struct ucred cred;
+    socklen_t    siz = sizeof(cred);
+
+    if (0 == getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &siz) && cred.uid == getuid()) {
+        if (pid) {
+            *pid = cred.pid;
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+#endif
+
+/*
+    All socket I/O goes through the following helpers. They tolerate EINTR and partial transfers, and only
+    poll() when the fd would block - so they work for fds >= FD_SETSIZE, and a blocking fd costs one syscall
+    per transfer. Writes use MSG_NOSIGNAL so that a dead peer gives EPIPE and not SIGPIPE. Those that only
+    libkgtk, or only kdialogd, uses are inline - so that the other's build does not warn that they are unused.
+*/
+/* Wait up to 'timeout' ms (-1 for ever) for 'events'. Returns 0 on error, or timeout (errno=ETIMEDOUT) */
+static int waitFd(int fd, short events, int timeout)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = events;
+
+    for (;;) {
+        int rv;
+
+        pfd.revents = 0;
+        rv = poll(&pfd, 1, timeout);
+
+        if (rv > 0) {
+            return 1;   /* Let read/write report any actual error */
+        } else if (0 == rv) {
+            errno = ETIMEDOUT;
+            return 0;
+        } else if (EINTR != errno) {
             return 0;
         }
+    }
+}
+
+/* Single sendmsg() of up to IOV_MAX buffers, with passFd (if not -1) attached. Returns as write() */
+static ssize_t sendSome(int fd, const struct iovec *iov, int count, int passFd, int flags)
+{
+    struct msghdr msg;
+    ssize_t       bytesWritten;
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = count > IOV_MAX ? IOV_MAX : count;
+
+    if (-1 != passFd) {
+        struct cmsghdr *cmsg;
+
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &passFd, sizeof(int));
+    }
+
+    bytesWritten = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+
+    if (bytesWritten < 0 && ENOTSOCK == errno && -1 == passFd) {
+        bytesWritten = writev(fd, iov, msg.msg_iovlen);
+    }
 
-        if (FD_ISSET(fd, &fdSet)) {
-            int bytesRead = read(fd, &pData[size - bytesToRead], bytesToRead);
+    return bytesWritten;
+}
 
-            if (bytesRead > 0) {
-                bytesToRead -= bytesRead;
-            } else {
+/*
+    Write 'count' buffers with as few sendmsg() calls as possible. iov is modified on partial writes! If passFd
+    is not -1, it is sent (SCM_RIGHTS) along with the first byte of the data.
+*/
+static int writeBlockVFd(int fd, struct iovec *iov, int count, int passFd)
+{
+    while (count > 0) {
+        ssize_t bytesWritten = sendSome(fd, iov, count, passFd, 0);
+
+        if (bytesWritten < 0) {
+            if (EINTR == errno) {
+                continue;
+            } else if ((EAGAIN != errno && EWOULDBLOCK != errno) || !waitFd(fd, POLLOUT, -1)) {
                 return 0;
             }
+        } else {
+            size_t written = (size_t)bytesWritten;
+
+            passFd = -1;    /* Has been sent */
+
+            while (count > 0 && written >= iov->iov_len) {
+                written -= iov->iov_len;
+                iov++;
+                count--;
+            }
+
+            if (count > 0) {
+                iov->iov_base = (char *)iov->iov_base + written;
+                iov->iov_len -= written;
+            }
         }
-    } while (bytesToRead > 0);
+    }
 
     return 1;
 }
 
+static int writeBlockV(int fd, struct iovec *iov, int count)
+{
+    return writeBlockVFd(fd, iov, count, -1);
+}
+
 static int writeBlock(int fd, const char *pData, int size)
 {
-    int bytesToWrite = size;
+    struct iovec iov;
 
-    do {
-        fd_set fdSet;
+    iov.iov_base = (void *)pData;
+    iov.iov_len = size;
+    return writeBlockV(fd, &iov, 1);
+}
 
-        FD_ZERO(&fdSet);
-        FD_SET(fd, &fdSet);
+/*
+    Buffered reader, so that a response made up of many small fields (e.g. a list of 10k selected files)
+    is read with a handful of read() calls, and not two per field. File descriptors passed with SCM_RIGHTS are
+    queued, in the order they arrived, and can be collected with takeFd(). If 'timeout' is set (in ms), then
+    each read fails if nothing arrives within that time.
+*/
+#define READ_BUFFER_SIZE 65536
+#define MAX_QUEUED_FDS   8
+
+typedef struct {
+    int    fd;
+    char   *data;
+    size_t size,
+           start,
+           end;
+    int    fds[MAX_QUEUED_FDS],
+           numFds,
+           timeout;
+} ReadBuffer;
+
+static void initReadBuffer(ReadBuffer *b, int fd)
+{
+    b->fd = fd;
+    b->data = NULL;
+    b->size = b->start = b->end = 0;
+    b->numFds = 0;
+    b->timeout = -1;
+}
 
-        if (select(fd + 1, NULL, &fdSet, NULL, NULL) < 0) {
-            return 0;
+static void freeReadBuffer(ReadBuffer *b)
+{
+    int i;
+
+    for (i = 0; i < b->numFds; ++i) {
+        close(b->fds[i]);
+    }
+
+    free(b->data);
+    initReadBuffer(b, -1);
+}
+
+static inline int takeFd(ReadBuffer *b)
+{
+    int fd;
+
+    if (0 == b->numFds) {
+        return -1;
+    }
+
+    fd = b->fds[0];
+    memmove(b->fds, &b->fds[1], (--b->numFds) * sizeof(int));
+    return fd;
+}
+
+/* Single recvmsg(), collecting any passed fds. Returns as read() */
+static ssize_t receiveSome(ReadBuffer *b, char *pData, size_t size)
+{
+    struct msghdr  msg;
+    struct iovec   iov;
+    struct cmsghdr *cmsg;
+    ssize_t        bytesRead;
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int) * MAX_QUEUED_FDS)];
+    } control;
+
+    if (b->timeout >= 0 && !waitFd(b->fd, POLLIN, b->timeout)) {
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = pData;
+    iov.iov_len = size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+#ifdef MSG_CMSG_CLOEXEC
+    bytesRead = recvmsg(b->fd, &msg, MSG_CMSG_CLOEXEC);
+#else
+    bytesRead = recvmsg(b->fd, &msg, 0);
+#endif
+
+    if (bytesRead < 0 && ENOTSOCK == errno) {
+        return read(b->fd, pData, size);
+    }
+
+    for (cmsg = bytesRead > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type) {
+            int num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int),
+                i;
+
+            for (i = 0; i < num; ++i) {
+                int fd;
+
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+                if (b->numFds < MAX_QUEUED_FDS) {
+                    b->fds[b->numFds++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
         }
 
-        if (FD_ISSET(fd, &fdSet)) {
-            int bytesWritten = write(fd, (char *)&pData[size - bytesToWrite], bytesToWrite);
+    return bytesRead;
+}
 
-            if (bytesWritten > 0) {
-                bytesToWrite -= bytesWritten;
-            } else {
-                return 0;
+static int readBuffered(ReadBuffer *b, char *pData, int size)
+{
+    int copied = 0;
+
+    while (copied < size) {
+        size_t  available = b->end - b->start;
+        ssize_t bytesRead;
+
+        if (available) {
+            size_t num = available < (size_t)(size - copied) ? available : (size_t)(size - copied);
+
+            memcpy(&pData[copied], &b->data[b->start], num);
+            b->start += num;
+            copied += num;
+            continue;
+        }
+
+        if ((size_t)(size - copied) >= READ_BUFFER_SIZE) {
+            /* Large block, read straight into the caller's memory */
+            if ((bytesRead = receiveSome(b, &pData[copied], size - copied)) > 0) {
+                copied += bytesRead;
+            }
+        } else {
+            if (!b->data) {
+                if (!(b->data = (char *)malloc(READ_BUFFER_SIZE))) {
+                    return 0;
+                }
+
+                b->size = READ_BUFFER_SIZE;
+            }
+
+            b->start = b->end = 0;
+
+            if ((bytesRead = receiveSome(b, b->data, b->size)) > 0) {
+                b->end = bytesRead;
             }
         }
-    } while (bytesToWrite > 0);
+
+        if (0 == bytesRead) {
+            return 0;
+        } else if (bytesRead < 0 && EINTR != errno &&
+                   ((EAGAIN != errno && EWOULDBLOCK != errno) || !waitFd(b->fd, POLLIN, -1))) {
+            return 0;
+        }
+    }
 
     return 1;
 }
 
+static inline size_t bufferedBytes(const ReadBuffer *b)
+{
+    return b->end - b->start;
+}
+
+/* Free the memory of a buffer that holds no data - for long lived, and mostly idle, connections */
+static inline void releaseReadBuffer(ReadBuffer *b)
+{
+    if (b->data && b->start == b->end) {
+        free(b->data);
+        b->data = NULL;
+        b->size = b->start = b->end = 0;
+    }
+}
+
+/*
+    For non-blocking fds: append whatever can be read now to the buffer, growing this as required - so that
+    the caller can check whether a whole message has arrived before reading it. Returns as read()
+*/
+static inline ssize_t fillReadBuffer(ReadBuffer *b)
+{
+    ssize_t bytesRead;
+
+    if (b->start && b->start == b->end) {
+        b->start = b->end = 0;
+    }
+
+    if (b->size - b->end < READ_BUFFER_SIZE / 4) {
+        if (b->start) {
+            memmove(b->data, &b->data[b->start], b->end - b->start);
+            b->end -= b->start;
+            b->start = 0;
+        }
+
+        if (b->size - b->end < READ_BUFFER_SIZE / 4) {
+            size_t newSize = b->size ? b->size * 2 : READ_BUFFER_SIZE;
+            char   *newData = (char *)realloc(b->data, newSize);
+
+            if (!newData) {
+                errno = ENOMEM;
+                return -1;
+            }
+
+            b->data = newData;
+            b->size = newSize;
+        }
+    }
+
+    do {
+        bytesRead = receiveSome(b, &b->data[b->end], b->size - b->end);
+    } while (bytesRead < 0 && EINTR == errno);
+
+    if (bytesRead > 0) {
+        b->end += bytesRead;
+    }
+
+    return bytesRead;
+}
+
 #ifdef KDIALOGD_APP
 /*
     So that kdailogd can terminate when the last app exits, need a way of synchronising the Gtk/Qt
-    apps that may wish to connect, and the removal of the socket.
+    apps that may wish to connect, and the removal of the socket. This also makes sure that when several apps
+    start at once, only one of them starts kdialogd.
 
-    To enable this, a lockfile is created, and used to guard around the critical sections
+    To enable this, flock() is used on a lockfile to guard around the critical sections. The kernel drops the
+    lock when its holder exits, so it can never go stale - and so the file itself is never removed.
 */
+#include <sys/file.h>
+
 static int lockFd = -1;
 
 #define LOCK_EXT ".lock"
@@ -212,39 +557,50 @@ static const char *getLockName()
     return lockName;
 }
 
-/* Lock is stale if it does not exist or is older than 2 seconds */
-static int isStale(const char *fname)
+/* Returns the lock fd, or -1. If 'wait' is 0, then fail at once if someone else holds the lock */
+static int grabLock(int wait)
 {
-    struct stat stat_buf;
+    const char *name = getLockName();
 
-    return 0 != stat(fname, &stat_buf) ||
-           labs(stat_buf.st_mtime - time(NULL)) > 2;
-}
+    if (!name || -1 != lockFd) {
+        return lockFd;
+    }
 
-static int grabLock(int tries)
-{
-    do {
-        lockFd = open(getLockName(), O_WRONLY | O_CREAT | O_EXCL, 0777);
-
-        if (lockFd < 0 && errno == EEXIST) {
-            /* Hmm, lock file already exists. Is it stale? */
-            if (isStale(getLockName())) {
-                tries++;  /* Increment tries so that we try again... */
-                unlink(getLockName());
-            } else if (tries) {
-                usleep(100000);
-            }
+    lockFd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (lockFd < 0 && ENOENT == errno) {
+        /* The socket folder is created by kdialogd - but apps need the lock before starting it */
+        char *dir = strdup(name);
+
+        if (dir && strrchr(dir, '/')) {
+            *strrchr(dir, '/') = '\0';
+            mkdir(dir, 0700);
+            lockFd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        }
+
+        free(dir);
+    }
+
+    if (lockFd >= 0) {
+        int rv;
+
+        while ((rv = flock(lockFd, LOCK_EX | (wait ? 0 : LOCK_NB))) < 0 && EINTR == errno);
+
+        if (rv < 0) {
+            close(lockFd);
+            lockFd = -1;
         }
-    } while (lockFd < 0 && --tries);
+    }
 
     return lockFd;
 }
 
 static void releaseLock()
 {
-    if (lockFd > 0) {
+    if (lockFd >= 0) {
+        flock(lockFd, LOCK_UN);
         close(lockFd);
-        unlink(getLockName());
+        lockFd = -1;
     }
 }
 #endif
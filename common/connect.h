@@ -34,13 +34,15 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #ifndef SUN_LEN
 #define SUN_LEN(ptr) ((socklen_t) (((struct sockaddr_un *) 0)->sun_path) \
                      + strlen ((ptr)->sun_path))
 #endif
 
-#include "common.h"
+#include "proto.h"
+#include "trace.h"
 #include "config.h"
 
 #ifdef __cplusplus
@@ -54,14 +56,105 @@ typedef gboolean kgtk_bool;
 #endif
 
 
-static int kdialogdSocket = -1;
+static int       kdialogdSocket = -1;
+static uint32_t  kdialogdCaps = 0;    /* Capabilities agreed with kdialogd during the handshake */
+static int       kdialogdWelcomeTimeout = 0; /* If set, kdialogd's WELCOME is still to be read, within this many ms */
+static int       kdialogdPid = -1;
+static kgtk_bool kdialogdAbstract = KGTK_FALSE;  /* Connected via the abstract socket? */
+
+/*
+    Deadlines (in ms) for connecting to, and for the handshake with, kdialogd - so that a hung kdialogd cannot
+    hang the app. These may be changed via the KGTK_CONNECT_TIMEOUT and KGTK_HANDSHAKE_TIMEOUT env vars.
+*/
+#define DEFAULT_CONNECT_TIMEOUT   2000
+#define DEFAULT_HANDSHAKE_TIMEOUT 2000
+
+static int getTimeout(const char *env, int def)
+{
+    const char *val = getenv(env);
+    int        timeout = val && val[0] ? atoi(val) : def;
+
+    return timeout > 0 ? timeout : def;
+}
+
+static int connectTimeout()
+{
+    static int timeout = -1;
+
+    if (-1 == timeout) {
+        timeout = getTimeout("KGTK_CONNECT_TIMEOUT", DEFAULT_CONNECT_TIMEOUT);
+    }
+
+    return timeout;
+}
+
+static int handshakeTimeout()
+{
+    static int timeout = -1;
+
+    if (-1 == timeout) {
+        timeout = getTimeout("KGTK_HANDSHAKE_TIMEOUT", DEFAULT_HANDSHAKE_TIMEOUT);
+    }
+
+    return timeout;
+}
+
+/* connect() with a deadline. For unix sockets this blocks only if kdialogd's backlog is full, and Linux bounds
+   that wait with SO_SNDTIMEO - which is then cleared again, so that it does not affect later writes. */
+static int connectWithTimeout(int sockfd, const struct sockaddr *addr, socklen_t len)
+{
+    struct timeval tv;
+    int            rv;
+
+    tv.tv_sec = connectTimeout() / 1000;
+    tv.tv_usec = (connectTimeout() % 1000) * 1000;
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    rv = connect(sockfd, addr, len);
+    tv.tv_sec = tv.tv_usec = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return rv;
+}
+
+#ifdef KGTK_ABSTRACT_SOCKET
+/* Fast path - connect to kdialogd's abstract socket, and take its pid from the connection itself */
+static int connectAbstractSocket()
+{
+    struct sockaddr_un addr;
+    socklen_t          len = getAbstractSockAddr(&addr);
+    pid_t              pid = -1;
+    int                sockfd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (sockfd < 0) {
+        return -1;
+    }
+
+    if (connectWithTimeout(sockfd, (struct sockaddr *)&addr, len) < 0 || !peerIsUs(sockfd, &pid)) {
+#ifdef KGTK_DEBUG
+
+        if (kgtkDebug & 0x01) {
+            printf("KGTK::connectAbstractSocket - failed, %d\n", errno);
+        }
+
+#endif
+        close(sockfd);
+        return -1;
+    }
+
+#ifdef KGTK_DEBUG
+
+    if (kgtkDebug & 0x01) {
+        printf("KGTK::connectAbstractSocket - sockfd:%d pid:%d\n", sockfd, pid);
+    }
+
+#endif
+    kdialogdPid = pid;
+    kdialogdAbstract = KGTK_TRUE;
+    return sockfd;
+}
+#endif
 
 /* From kdelibs/kdesu */
-#ifdef KDIALOGD_APP
-static int createSocketConnectionReal()
-#else
 static int createSocketConnection()
-#endif
 {
 #ifdef KGTK_DEBUG
 
@@ -74,6 +167,14 @@ static int createSocketConnection()
     const char *sock = getSockName();
     struct sockaddr_un addr;
 
+#ifdef KGTK_ABSTRACT_SOCKET
+
+    if (-1 != (sockfd = connectAbstractSocket())) {
+        return sockfd;
+    }
+
+#endif
+
     if (access(sock, R_OK | W_OK)) {
 #ifdef KGTK_DEBUG
 
@@ -101,7 +202,7 @@ static int createSocketConnection()
     addr.sun_family = AF_UNIX;
     strcpy(addr.sun_path, sock);
 
-    if (connect(sockfd, (struct sockaddr *) &addr, SUN_LEN(&addr)) < 0) {
+    if (connectWithTimeout(sockfd, (struct sockaddr *) &addr, SUN_LEN(&addr)) < 0) {
 #ifdef KGTK_DEBUG
 
         if (kgtkDebug & 0x01) {
@@ -214,28 +315,6 @@ static int createSocketConnection()
     return sockfd;
 }
 
-#ifdef KDIALOGD_APP
-static int createSocketConnection()
-{
-    int rv = -1,
-        tries = 0;
-
-    do {
-        if (-1 == (rv = createSocketConnectionReal())) {
-            usleep(100000);
-        }
-    } while (-1 == rv && ++tries < 50);
-
-    if (-1 == rv) {
-        fprintf(stderr, "ERROR: Could not talk to KDialogD!!!\n");
-    }
-
-    return rv;
-}
-#endif
-
-static int kdialogdPid = -1;
-
 static kgtk_bool processIsRunning()
 {
 #ifdef KGTK_DEBUG
@@ -322,10 +401,223 @@ static void closeConnection()
 #endif
     close(kdialogdSocket);
     kdialogdSocket = -1;
+    kdialogdAbstract = KGTK_FALSE;
+    kdialogdWelcomeTimeout = 0;
+}
+
+/* Read kdialogd's WELCOME, waiting up to 'timeout' ms for it */
+static kgtk_bool readWelcome(ReadBuffer *in, int timeout)
+{
+    uint32_t  version = 0,
+              caps = 0;
+    int       prevTimeout = in->timeout,
+              err;
+    uint64_t  start = traceNow();
+    kgtk_bool rv;
+
+    in->timeout = timeout;
+    rv = readHandshake(in, MSG_WELCOME, &version, &caps);
+    err = errno;
+    in->timeout = prevTimeout;
+
+    if (rv) {
+        kdialogdCaps = caps & KGTK_CAPS;
+    } else if (version) {
+        fprintf(stderr, "ERROR: KDialogD protocol mismatch (ours:%d theirs:%u)\n", KGTK_PROTOCOL_VERSION, version);
+    } else if (ETIMEDOUT == err) {
+        fprintf(stderr, "ERROR: KDialogD did not respond within %dms\n", timeout);
+    }
+
+    traceSpan("welcome", NULL, start);
+    return rv;
+}
+
+/* Read the WELCOME from a kdialogd that we did not wait for, if it is still to be read */
+static kgtk_bool readPendingWelcome(ReadBuffer *in)
+{
+    int timeout = kdialogdWelcomeTimeout;
+
+    kdialogdWelcomeTimeout = 0;
+    return 0 == timeout || readWelcome(in, timeout);
+}
+
+/* Only valid whilst no requests are outstanding on the connection */
+static kgtk_bool connectionAlive()
+{
+    /* kdialogd only sends between requests to say goodbye, so if the socket is readable it has gone away */
+    struct pollfd pfd;
+
+    pfd.fd = kdialogdSocket;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, 0);
+
+    if (kdialogdWelcomeTimeout) {
+        ReadBuffer in;
+        kgtk_bool  rv;
+
+        /* kdialogd is still starting - the reader will get its WELCOME */
+        if (0 == pfd.revents) {
+            return KGTK_TRUE;
+        }
+
+        initReadBuffer(&in, kdialogdSocket);
+        rv = readPendingWelcome(&in);
+        freeReadBuffer(&in);
+
+        if (!rv) {
+            return KGTK_FALSE;
+        }
+
+        pfd.revents = 0;
+        poll(&pfd, 1, 0);
+    }
+
+    if (0 != pfd.revents) {
+        return KGTK_FALSE;
+    }
+
+#ifdef KGTK_ABSTRACT_SOCKET
+
+    if (kdialogdAbstract) {
+        return KGTK_TRUE;
+    }
+
+#endif
+    {
+        uint64_t  start = traceNow();
+        kgtk_bool running = processIsRunning();
+
+        traceSpan("processIsRunning", NULL, start);
+        return running;
+    }
+}
+
+#ifdef KDIALOGD_APP
+#include <spawn.h>
+
+extern char **environ;
+
+#define KGTK_READY_FD      3
+#define KGTK_SPAWN_TIMEOUT 5000 /* ms */
+
+/*
+    Start kdialogd via its launcher, and wait for it to say that its socket is listening - it writes a byte to
+    the pipe passed as KGTK_READY_FD once it is, and the pipe is closed if it fails. posix_spawn is used, as
+    calling 'fork' seems to mess things up with eclipse!
+*/
+static kgtk_bool spawnKDialogD()
+{
+    static char *const         argv[] = { (char *)"kdialogd5", (char *)"--launch", (char *)"--ready-fd=3", NULL };
+    posix_spawn_file_actions_t actions;
+    pid_t                      pid;
+    int                        ready[2];
+    kgtk_bool                  rv = KGTK_FALSE;
+
+    if (pipe2(ready, O_CLOEXEC) < 0) {
+        return KGTK_FALSE;
+    }
+
+    /* dup2() onto the same fd would leave it close-on-exec */
+    if (KGTK_READY_FD == ready[1]) {
+        int fd = fcntl(ready[1], F_DUPFD_CLOEXEC, KGTK_READY_FD + 1);
+
+        close(ready[1]);
+        ready[1] = fd;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, ready[1], KGTK_READY_FD);
+
+    if (ready[1] >= 0 && 0 == posix_spawn(&pid, KDIALOGD_LOCATION"/kdialogd5", &actions, NULL, argv, environ)) {
+        struct pollfd pfd;
+        char          c;
+        int           status = 0;
+
+        close(ready[1]);
+        ready[1] = -1;
+        pfd.fd = ready[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        while (poll(&pfd, 1, KGTK_SPAWN_TIMEOUT) < 0 && EINTR == errno);
+
+        rv = (pfd.revents & POLLIN) && 1 == read(ready[0], &c, 1);
+
+        /* The launcher exits once the daemon is started - if it is stuck, dont leave it behind */
+        if (!rv && 0 == waitpid(pid, &status, WNOHANG)) {
+            kill(pid, SIGKILL);
+        }
+
+        waitpid(pid, &status, 0);
+    }
+
+#ifdef KGTK_DEBUG
+
+    if (kgtkDebug & 0x01) {
+        printf("KGTK::spawnKDialogD - ready:%d\n", rv);
+    }
+
+#endif
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (ready[1] >= 0) {
+        close(ready[1]);
+    }
+
+    close(ready[0]);
+
+    if (!rv) {
+        fprintf(stderr, "ERROR: Could not start KDialogD!!!\n");
+    }
+
+    return rv;
+}
+
+/*
+    How long (in ms) to wait for the WELCOME from a kdialogd that we have just started. This is only sent once
+    Qt has initialised, which can take much longer than the handshake with a running kdialogd - so allow at
+    least as long as it had to start.
+*/
+static int startupTimeout()
+{
+    return handshakeTimeout() > KGTK_SPAWN_TIMEOUT ? handshakeTimeout() : KGTK_SPAWN_TIMEOUT;
 }
+#endif
 
-/* Note: Calling 'fork' seems to mess things up with eclipse! */
-#define KGTK_USE_SYSTEM_CALL
+/* Send our app name, and the HELLO */
+static kgtk_bool sendHello(const char *appName)
+{
+    unsigned int slen = strlen(appName);
+    char         len[4];
+
+    if (slen) {
+        slen++;
+    }
+
+    putU32(len, slen);
+    return writeBlock(kdialogdSocket, len, sizeof(len)) &&
+           (0 == slen || writeBlock(kdialogdSocket, appName, slen)) &&
+           writeHandshake(kdialogdSocket, MSG_HELLO, KGTK_CAPS);
+}
+
+/* Send our app name, and the HELLO - then wait up to 'timeout' ms for kdialogd's WELCOME */
+static kgtk_bool handshake(const char *appName, int timeout)
+{
+    uint64_t  start = traceNow();
+    kgtk_bool rv = sendHello(appName);
+
+    if (rv) {
+        ReadBuffer in;
+
+        initReadBuffer(&in, kdialogdSocket);
+        rv = readWelcome(&in, timeout);
+        freeReadBuffer(&in);
+    }
+
+    traceSpan("handshake", NULL, start);
+    return rv;
+}
 
 static kgtk_bool connectToKDialogD(const char *appName)
 {
@@ -337,70 +629,84 @@ static kgtk_bool connectToKDialogD(const char *appName)
 
 #endif
 
-    if (!processIsRunning()) {
+    if (-1 != kdialogdSocket && !connectionAlive()) {
         closeConnection();
     }
 
     if (-1 != kdialogdSocket) {
         return KGTK_TRUE;
     } else {
-        unsigned int slen = strlen(appName);
-        kgtk_bool    rv = KGTK_TRUE;
+        kgtk_bool rv = KGTK_FALSE;
 
-        if (slen) {
-            slen++;
-        }
+#ifdef KGTK_ABSTRACT_SOCKET
 
-#ifdef KGTK_DEBUG
+        /* If kdialogd is already running, there is no need to start it - or to take the lock. This can race
+           with kdialogd exiting on its idle timeout, in which case the handshake fails, and we go the slow way */
+        if (-1 != (kdialogdSocket = connectAbstractSocket()) && handshake(appName, handshakeTimeout())) {
+            return KGTK_TRUE;
+        }
 
-        if (kgtkDebug & 0x01) {
-            printf("KGTK::connectToKDialogD - start app\n");
+        if (-1 != kdialogdSocket) {
+            closeConnection();
         }
 
 #endif
 
 #ifdef KDIALOGD_APP
-        grabLock(5);
-#ifdef KGTK_USE_SYSTEM_CALL
-        system(KDIALOGD_LOCATION"/kdialogd5 &");
-#else
 
-        switch (fork()) {
-        case -1:
-            rv = KGTK_FALSE;
-            printf("ERROR: Could not start fork :-(\n");
-            break;
+        uint64_t start = traceNow();
+
+        /* Whilst we hold the lock kdialogd will not exit, and no other app will start it. So check again
+           whether it is running once we have the lock - if several apps start at once, only the first starts
+           kdialogd and the others then just connect to it. */
+        if (grabLock(1) >= 0) {
+            kgtk_bool spawned = KGTK_FALSE;
+
+            traceSpan("grabLock", NULL, start);
+            start = traceNow();
+            kdialogdSocket = createSocketConnection();
+            traceSpan("createSocketConnection", NULL, start);
 
-        case 0:
-            execl(KDIALOGD_LOCATION"/kdialogd5", "kdialogd5", (char *)NULL);
-            break;
+            if (-1 == kdialogdSocket) {
+                start = traceNow();
+                spawned = spawnKDialogD();
+                traceSpan("spawnKDialogD", NULL, start);
 
-        default: {
-            int status = 0;
-            wait(&status);
+                if (spawned) {
+                    kdialogdSocket = createSocketConnection();
+                }
+            }
+
+            if (spawned) {
+                /* kdialogd only says WELCOME once Qt has started, so dont wait for it here - send the request
+                   now, and have the reader wait for the WELCOME first. Until then, assume no capabilities. */
+                start = traceNow();
+                rv = -1 != kdialogdSocket && sendHello(appName);
+                traceSpan("handshake", NULL, start);
+
+                if (rv) {
+                    kdialogdCaps = 0;
+                    kdialogdWelcomeTimeout = startupTimeout();
+                }
+            } else {
+                rv = -1 != kdialogdSocket && handshake(appName, handshakeTimeout());
+            }
+            releaseLock();
         }
+
+#else
+
+        if (0 == system("dcop kded kded loadModule kdialogd") &&
+                -1 != (kdialogdSocket = createSocketConnection())) {
+            rv = handshake(appName, handshakeTimeout());
         }
 
-#endif
-        releaseLock();
 #endif
 
-        if (!rv) {
-            return rv;
+        if (!rv && -1 != kdialogdSocket) {
+            closeConnection();
         }
 
-        rv =
-#ifdef KDIALOGD_APP
-            grabLock(3) > 0 &&
-#else
-            0 == system("dcop kded kded loadModule kdialogd") &&
-#endif
-            -1 != (kdialogdSocket = createSocketConnection()) &&
-            writeBlock(kdialogdSocket, (char *)&slen, 4) &&
-            (0 == slen || writeBlock(kdialogdSocket, appName, slen));
-#ifdef KDIALOGD_APP
-        releaseLock();
-#endif
         return rv;
     }
 }
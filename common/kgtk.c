@@ -72,6 +72,7 @@ TODO
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdarg.h>
 #include <ctype.h>
 #include "connect.h"
@@ -106,12 +107,9 @@ typedef enum {
 
 static const char  *kgtkAppName = NULL;
 static gboolean    useKde = FALSE;
-static gboolean    kdialogdError = FALSE;
-static GMainLoop   *kdialogdLoop = NULL;
 static const gchar *kgtkFileFilter = NULL;
 static Application kgtkApp = APP_ANY;
 
-#define MAX_DATA_LEN 4096
 #define MAX_FILTER_LEN 256
 #define MAX_LINE_LEN 1024
 #define MAX_APP_NAME_LEN 32
@@ -180,72 +178,382 @@ static const gchar *getAppName(const gchar *app)
     return appName;
 }
 
-static gboolean writeString(const char *s)
+/*
+    Requests that have been sent to kdialogd, and are waiting for a reply. Each request is identified by its
+    id, so several dialogs (e.g. from different windows) may be open at once over the one connection. Replies
+    are read by a single reader thread, which is started when a request is sent and none is running, and
+    which exits once there are no more pending requests.
+*/
+typedef struct {
+    guint32  id;
+    gboolean done,
+             error,
+             retry;   /* kdialogd said goodbye before reading this, so it may be sent again */
+    GSList   *res;
+    gchar    *selFilter;
+    gchar    *customRv;
+    char     traceId[TRACE_ID_LEN];   /* Correlation id, if tracing - see trace.h */
+} KGtkRequest;
+
+G_LOCK_DEFINE_STATIC(requests);
+static GSList   *pendingRequests = NULL;
+static gboolean readerRunning = FALSE;
+static gboolean connectionBroken = FALSE;
+
+static guint32 nextRequestId()
 {
-    unsigned int slen = strlen(s) + 1;
+    static guint32 lastId = 0;
 
-    return writeBlock(kdialogdSocket, (char *)&slen, 4) &&
-           writeBlock(kdialogdSocket, s, slen);
+    if (0 == ++lastId) {
+        ++lastId;
+    }
+
+    return lastId;
 }
 
-static gboolean writeBool(gboolean b)
+static gboolean havePendingRequests()
 {
-    char bv = b ? 1 : 0;
+    gboolean rv;
 
-    return writeBlock(kdialogdSocket, (char *)&bv, 1);
+    G_LOCK(requests);
+    rv = NULL != pendingRequests;
+    G_UNLOCK(requests);
+    return rv;
 }
 
-typedef struct {
-    GSList *res;
-    gchar  *selFilter;
-    gchar  *customRv;
-} KGtkData;
+/* Must be called with the requests lock held */
+static KGtkRequest *findRequest(guint32 id)
+{
+    GSList *item;
+
+    for (item = pendingRequests; item; item = g_slist_next(item))
+        if (((KGtkRequest *)item->data)->id == id) {
+            return (KGtkRequest *)item->data;
+        }
+
+    return NULL;
+}
+
+static gboolean addPath(KGtkRequest *req, const Field *f)
+{
+    if (fieldIsString(f) && f->length) {
+        gchar *file = g_filename_from_utf8(f->data, f->length, NULL, NULL, NULL);
+
+        if (file) {
+            req->res = g_slist_prepend(req->res, file);
+        }
+
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+#ifdef HAVE_MEMFD_CREATE
+/* Large path lists are passed in a sealed memfd - map this, and read the paths straight from the mapping */
+static gboolean readSharedPaths(KGtkRequest *req, int fd, uint32_t len)
+{
+    gboolean    rv = FALSE;
+    struct stat info;
+    int         seals = fd < 0 ? -1 : fcntl(fd, F_GET_SEALS);
+
+    /* Only trust the table if it can no longer be written to, or shrunk underneath us */
+    if (seals >= 0 && (F_SEAL_WRITE | F_SEAL_SHRINK) == (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) &&
+            0 == fstat(fd, &info) && info.st_size >= (off_t)len) {
+        void *map = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+
+        if (!len) {
+            rv = TRUE;
+        } else if (MAP_FAILED != map) {
+            FieldIter it;
+            Field     f;
+            int       r = 0;
+
+            rv = TRUE;
+            initFieldIter(&it, (const char *)map, len);
+
+            while (rv && (r = nextField(&it, &f)) > 0) {
+                rv = FIELD_PATH == f.tag && addPath(req, &f);
+            }
+
+            rv = rv && 0 == r;
+            munmap(map, len);
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return rv;
+}
+#endif
+
+/* Add the fields of a RESULT, or RESULT_PART, frame to 'req'. Paths are decoded as each part arrives, so
+   that only one batch at a time is ever held in its encoded form */
+static gboolean readResult(ReadBuffer *in, const Buffer *payload, KGtkRequest *req)
+{
+    FieldIter it;
+    Field     f;
+    int       rv = 0;
+    int       accepted = 1;
+
+    initFieldIter(&it, payload->data, payload->len);
+
+    while ((rv = nextField(&it, &f)) > 0) {
+        switch (f.tag) {
+        case FIELD_ACCEPTED:
+            if (!fieldBool(&f, &accepted)) {
+                return FALSE;
+            }
+
+            break;
+
+        case FIELD_PATH:
+            if (!addPath(req, &f)) {
+                return FALSE;
+            }
+
+            break;
+
+        case FIELD_SHARED_PATHS: {
+            uint32_t len;
+            int      fd = takeFd(in);
+
+#ifdef HAVE_MEMFD_CREATE
+
+            if (!fieldU32(&f, &len) || !readSharedPaths(req, fd, len)) {
+                return FALSE;
+            }
+
+            break;
+#else
+
+            if (fd >= 0) {
+                close(fd);
+            }
+
+            return FALSE;
+#endif
+        }
+
+        case FIELD_SELECTED_FILTER:
+            if (!fieldIsString(&f)) {
+                return FALSE;
+            } else if (!req->selFilter && f.length) {
+                req->selFilter = g_strndup(f.data, f.length);
+            }
+
+            break;
+
+        case FIELD_CUSTOM_RESULT:
+            if (!fieldIsString(&f)) {
+                return FALSE;
+            } else if (!req->customRv && f.length) {
+                req->customRv = g_strndup(f.data, f.length);
+            }
+
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    /* Cancelled, or failed, after some paths had already been streamed - so forget these */
+    if (!accepted && req->res) {
+        g_slist_foreach(req->res, (GFunc)g_free, NULL);
+        g_slist_free(req->res);
+        req->res = NULL;
+    }
+
+    return 0 == rv;
+}
 
 static gpointer kdialogdMain(gpointer data)
 {
-    KGtkData *d = (KGtkData *)data;
-    char     buffer[MAX_DATA_LEN + 1] = {'\0'};
-    int      num = 0;
-
-    if (readBlock(kdialogdSocket, (char *)&num, 4)) {
-        int n;
-
-        for (n = 0; n < num && !kdialogdError; ++n) {
-            int size = 0;
-
-            if (readBlock(kdialogdSocket, (char *)&size, 4)) {
-                if (size > 0) {
-                    if (size <= MAX_DATA_LEN && readBlock(kdialogdSocket, buffer, size)) {
-                        /*buffer[size-1]='\0'; */
-                        if ('/' == buffer[0]) {
-                            d->res = g_slist_prepend(d->res, g_filename_from_utf8(buffer, -1, NULL, NULL, NULL));
-                        } else if ('@' == buffer[0] && '@' == buffer[1] && !(d->customRv)) {
-                            d->customRv = g_strdup(buffer);
-                        } else if (!(d->selFilter)) {
-                            d->selFilter = g_strdup(buffer);
-                        }
-                    } else {
-                        kdialogdError = TRUE;
-                    }
-                }
-            } else {
-                kdialogdError = TRUE;
+    ReadBuffer  in;
+    FrameHeader h;
+    Buffer      payload;
+    gboolean    ok = TRUE,
+                goodbye = FALSE;
+
+    initReadBuffer(&in, GPOINTER_TO_INT(data));
+    initBuffer(&payload);
+
+    while (ok) {
+        KGtkRequest *req = NULL;
+
+        G_LOCK(requests);
+
+        if (!pendingRequests) {
+            readerRunning = FALSE;
+            G_UNLOCK(requests);
+            break;
+        }
+
+        G_UNLOCK(requests);
+
+        if (!readPendingWelcome(&in)) {
+            /* A kdialogd that we started did not come up, so the request we queued for it will not be read */
+            ok = FALSE;
+        } else if ((ok = readFrame(&in, &h, &payload)) && MSG_GOODBYE == h.type && (kdialogdCaps & CAP_GOODBYE)) {
+            /* kdialogd closed the connection as it was idle, and so has not seen what is still pending */
+            ok = FALSE;
+            goodbye = TRUE;
+        } else if ((ok = ok && (MSG_RESULT == h.type || (MSG_RESULT_PART == h.type && (kdialogdCaps & CAP_STREAM))))) {
+            uint64_t start = traceNow();
+
+            G_LOCK(requests);
+            req = findRequest(h.id);
+            G_UNLOCK(requests);
+
+            /* Only the reader touches a request until it is marked as done, so parse without the lock */
+            ok = req && readResult(&in, &payload, req);
+
+            if (req && MSG_RESULT == h.type) {
+                traceFlow("result", req->traceId, FALSE, start);
+                traceSpan("readResult", req->traceId, start);
             }
         }
-    } else {
-        kdialogdError = TRUE;
+
+        if (ok && MSG_RESULT_PART == h.type) {
+            continue;
+        }
+
+        G_LOCK(requests);
+
+        if (ok) {
+            req->done = TRUE;
+            pendingRequests = g_slist_remove(pendingRequests, req);
+        } else {
+            /* Connection is broken, fail everything that was waiting on it */
+            GSList *item;
+
+            for (item = pendingRequests; item; item = g_slist_next(item)) {
+                ((KGtkRequest *)item->data)->error = TRUE;
+                ((KGtkRequest *)item->data)->retry = goodbye;
+                ((KGtkRequest *)item->data)->done = TRUE;
+            }
+
+            g_slist_free(pendingRequests);
+            pendingRequests = NULL;
+            readerRunning = FALSE;
+            connectionBroken = TRUE;
+        }
+
+        G_UNLOCK(requests);
+        g_main_context_wakeup(NULL);
     }
 
-    if (g_main_loop_is_running(kdialogdLoop)) {
-        g_main_loop_quit(kdialogdLoop);
+    freeBuffer(&payload);
+    freeReadBuffer(&in);
+    return 0L;
+}
+
+/* Run a nested main loop until the reader thread has the reply for 'req' */
+static void waitForRequest(KGtkRequest *req)
+{
+    for (;;) {
+        gboolean done;
+
+        G_LOCK(requests);
+        done = req->done;
+        G_UNLOCK(requests);
+
+        if (done) {
+            break;
+        }
+
+        g_main_context_iteration(NULL, TRUE);
     }
+}
+
+/*
+    The connection to kdialogd is only made when it is first needed - most processes never show a file dialog,
+    and should not have to wait for (or start) kdialogd. When an app creates a file chooser dialog, the
+    connection is started on a background thread, so that it is usually ready by the time the dialog is run.
+*/
+G_LOCK_DEFINE_STATIC(connection);
+
+static gboolean ensureConnection()
+{
+    gboolean rv;
 
+    /* Dont check, or replace, the connection whilst other dialogs are still waiting on it */
+    G_LOCK(connection);
+    rv = (-1 != kdialogdSocket && havePendingRequests()) || connectToKDialogD(getAppName(kgtkAppName));
+    G_UNLOCK(connection);
+    return rv;
+}
+
+static gpointer warmConnectionMain(gpointer data)
+{
+    ensureConnection();
     return 0L;
 }
 
-static gboolean sendMessage(GtkWidget *widget, Operation op, GSList **res, gchar **selFilter, gchar **customRv,
-                            const char *title, const char *p1, const char *p2, const char *p3, gboolean overWrite)
+static void warmConnection()
+{
+    static gboolean started = FALSE;
+
+    if (!started && useKde) {
+        started = TRUE;
+        g_thread_create(&warmConnectionMain, NULL, FALSE, NULL);
+    }
+}
+
+/* Tell kdialogd that we no longer want the result of request 'id' - it will still send a (cancelled) reply */
+static void cancelRequest(guint32 id)
+{
+    Buffer msg;
+    size_t frame;
+
+#ifdef KGTK_DEBUG
+
+    if (kgtkDebug & 0x02) {
+        printf("KGTK::cancelRequest %u\n", id);
+    }
+
+#endif
+
+    if (-1 == kdialogdSocket || !(kdialogdCaps & CAP_CANCEL)) {
+        return;
+    }
+
+    initBuffer(&msg);
+    frame = beginFrame(&msg, MSG_CANCEL, id);
+    endFrame(&msg, frame);
+
+    /* If this fails, the reader will notice the broken connection */
+    writeBuffer(kdialogdSocket, &msg);
+    freeBuffer(&msg);
+}
+
+static void chooserDestroyed(GtkWidget *widget, gpointer id)
 {
+    cancelRequest(GPOINTER_TO_UINT(id));
+}
+
+/* The correlation id of request 'id' - or empty, if not tracing. Request ids are only unique within a process */
+static void requestTraceId(char *traceId, guint32 id)
+{
+    traceId[0] = '\0';
+
+    if (tracing()) {
+        snprintf(traceId, TRACE_ID_LEN, "%d-%u", tracePid, id);
+    }
+}
+
+/* Returns FALSE if the request failed - with 'retry' set if it is safe to send it again, on a new connection */
+static gboolean sendMessage(GtkWidget *widget, guint32 id, Operation op, GSList **res, gchar **selFilter, gchar **customRv,
+                            const char *title, const char *p1, const char *p2, const char *p3, gboolean overWrite,
+                            gboolean *retry)
+{
+    char     traceId[TRACE_ID_LEN];
+    uint64_t start = traceNow();
+    gboolean connected;
+
 #ifdef KGTK_DEBUG
 
     if (kgtkDebug & 0x02) {
@@ -254,9 +562,13 @@ static gboolean sendMessage(GtkWidget *widget, Operation op, GSList **res, gchar
 
 #endif
 
-    if (connectToKDialogD(getAppName(kgtkAppName))) {
-        char o = (char)op;
-        int  xid = 0;
+    *retry = FALSE;
+    requestTraceId(traceId, id);
+    connected = ensureConnection();
+    traceSpan("connect", traceId, start);
+
+    if (connected) {
+        int xid = 0;
 
         if (widget) {
             if (gtk_widget_get_parent(widget)) {
@@ -333,20 +645,89 @@ static gboolean sendMessage(GtkWidget *widget, Operation op, GSList **res, gchar
             g_list_free(topWindows);
         }
 
-        if (writeBlock(kdialogdSocket, &o, 1) &&
-                writeBlock(kdialogdSocket, (char *)&xid, 4) &&
-                writeString(title) &&
-                (p1 ? writeString(p1) : TRUE) &&
-                (p2 ? writeString(p2) : TRUE) &&
-                (p3 ? writeString(p3) : TRUE) &&
-                (OP_FILE_SAVE == op ? writeBool(overWrite) : TRUE)) {
+        /* Build the whole request, and send it in one go */
+        Buffer      msg;
+        size_t      frame;
+        gboolean    sent,
+                    startReader;
+        KGtkRequest req;
+
+        initBuffer(&msg);
+        frame = beginFrame(&msg, MSG_OPEN, id);
+        addU32Field(&msg, FIELD_OPERATION, op);
+        addU32Field(&msg, FIELD_XID, xid);
+        addStringField(&msg, FIELD_TITLE, title, strlen(title));
+
+        if (p1) {
+            addStringField(&msg, FIELD_START_DIR, p1, strlen(p1));
+        }
+
+        if (p2) {
+            addStringField(&msg, FIELD_FILTER, p2, strlen(p2));
+        }
+
+        if (p3) {
+            addStringField(&msg, FIELD_CUSTOM_WIDGETS, p3, strlen(p3));
+        }
+
+        if (OP_FILE_SAVE == op) {
+            addBoolField(&msg, FIELD_OVERWRITE, overWrite);
+        }
+
+        if (traceId[0]) {
+            addStringField(&msg, FIELD_TRACE_ID, traceId, strlen(traceId));
+        }
+
+        endFrame(&msg, frame);
+
+        req.id = id;
+        req.done = req.error = req.retry = FALSE;
+        req.res = NULL;
+        req.selFilter = NULL;
+        req.customRv = NULL;
+        memcpy(req.traceId, traceId, sizeof(traceId));
+
+        /* Register the request before sending, so that the reader can never see a reply it does not know */
+        G_LOCK(requests);
+        pendingRequests = g_slist_prepend(pendingRequests, &req);
+        startReader = !readerRunning;
+        readerRunning = TRUE;
+        G_UNLOCK(requests);
+
+        start = traceNow();
+        traceFlow("request", traceId, TRUE, start);
+        sent = writeBuffer(kdialogdSocket, &msg);
+        traceSpan("send", traceId, start);
+        freeBuffer(&msg);
+
+        if (!sent) {
+            gboolean others;
+
+            G_LOCK(requests);
+            pendingRequests = g_slist_remove(pendingRequests, &req);
+            others = NULL != pendingRequests;
+
+            if (startReader) {
+                readerRunning = FALSE;
+            }
+
+            G_UNLOCK(requests);
+
+            /* If other requests are pending, the reader will notice the broken connection. Otherwise kdialogd
+               may just have closed it as idle, before this was written - so try again on a new one */
+            if (!others) {
+                closeConnection();
+                *retry = TRUE;
+            }
+        } else {
             GtkWidget *dlg = gtk_dialog_new();
-            KGtkData  d;
+            gboolean  broken = FALSE;
+
+            if (startReader) {
+                g_thread_create(&kdialogdMain, GINT_TO_POINTER(kdialogdSocket), FALSE, NULL);
+            }
 
             gtk_widget_set_name(dlg, "--kgtk-modal-dialog-hack--");
-            d.res = NULL;
-            d.selFilter = NULL;
-            d.customRv = NULL;
 
             /* Create a tmporary, hidden, dialog so that the kde dialog appears as modal */
             g_object_ref(dlg);
@@ -364,45 +745,62 @@ static gboolean sendMessage(GtkWidget *widget, Operation op, GSList **res, gchar
             gtk_window_move(GTK_WINDOW(dlg), 32768, 32768);
             gtk_window_set_skip_taskbar_hint(GTK_WINDOW(dlg), TRUE);
             gtk_window_set_skip_pager_hint(GTK_WINDOW(dlg), TRUE);
-            kdialogdLoop = g_main_loop_new(NULL, FALSE);
-            kdialogdError = FALSE;
-            g_thread_create(&kdialogdMain, &d, FALSE, NULL);
 
             GDK_THREADS_LEAVE();
-            g_main_loop_run(kdialogdLoop);
+            start = traceNow();
+            waitForRequest(&req);
+            traceSpan("wait", traceId, start);
             GDK_THREADS_ENTER();
-            g_main_loop_unref(kdialogdLoop);
-            kdialogdLoop = NULL;
             gtk_window_set_modal(GTK_WINDOW(dlg), FALSE);
             g_object_unref(dlg);
             gtk_widget_destroy(dlg);
 
-            if (kdialogdError) {
-                closeConnection();
+            if (req.error) {
+                /* Only the first request to notice a broken connection closes it - the others may return
+                   after we have already reconnected */
+                G_LOCK(requests);
+                broken = connectionBroken;
+                connectionBroken = FALSE;
+                G_UNLOCK(requests);
+
+                if (broken) {
+                    closeConnection();
+                }
+
+                *retry = req.retry;
+
+                if (req.res) {
+                    g_slist_foreach(req.res, (GFunc)g_free, NULL);
+                    g_slist_free(req.res);
+                }
+
+                g_free(req.selFilter);
+                g_free(req.customRv);
                 return FALSE;
             }
 
-            if (d.res) {
+            if (req.res) {
                 if (res) {
-                    *res = d.res;
+                    *res = req.res;
                 } else {
-                    g_slist_free(d.res);
+                    g_slist_foreach(req.res, (GFunc)g_free, NULL);
+                    g_slist_free(req.res);
                 }
             }
 
-            if (d.selFilter) {
+            if (req.selFilter) {
                 if (selFilter) {
-                    *selFilter = d.selFilter;
+                    *selFilter = req.selFilter;
                 } else {
-                    g_free(d.selFilter);
+                    g_free(req.selFilter);
                 }
             }
 
-            if (d.customRv) {
+            if (req.customRv) {
                 if (customRv) {
-                    *customRv = d.customRv;
+                    *customRv = req.customRv;
                 } else {
-                    g_free(d.customRv);
+                    g_free(req.customRv);
                 }
             }
 
@@ -440,17 +838,73 @@ static const char *getTitle(const char *title)
     return ".";
 }
 
-static gboolean openKdeDialog(GtkWidget *widget, const char *title, const char *p1, const char *p2, const char *p3,
-                              Operation op, GSList **res, gchar **selFilter, gchar **customRv, gboolean overWrite)
+/*
+    Circuit breaker - if we repeatedly fail to talk to, or start, kdialogd then dont keep trying, just fall back
+    to the Gtk dialog. After a cool-down period one request is let through to see if kdialogd has recovered; if
+    this also fails the cool-down is doubled, up to a limit.
+*/
+#define BREAKER_FAILURES     3
+#define BREAKER_COOLDOWN     (30 * G_USEC_PER_SEC)
+#define BREAKER_MAX_COOLDOWN (10 * 60 * G_USEC_PER_SEC)
+
+static int    breakerFailures = 0;
+static gint64 breakerCooldown = BREAKER_COOLDOWN;
+static gint64 breakerOpenUntil = 0;
+
+static gboolean breakerClosed()
 {
-    gboolean rv = sendMessage(widget, op, res, selFilter, customRv, getTitle(title), p1, p2, p3, overWrite);
+    return breakerFailures < BREAKER_FAILURES || g_get_monotonic_time() >= breakerOpenUntil;
+}
 
-    /* If we failed to talk to, or start kdialogd, then dont keep trying - just fall back to Gtk */
-    /*
-         if(!rv)
-             useKde=FALSE;
-    */
+static void breakerUpdate(gboolean ok)
+{
+    if (ok) {
+        breakerFailures = 0;
+        breakerCooldown = BREAKER_COOLDOWN;
+    } else if (++breakerFailures >= BREAKER_FAILURES) {
+        breakerOpenUntil = g_get_monotonic_time() + breakerCooldown;
+
+        if ((breakerCooldown *= 2) > BREAKER_MAX_COOLDOWN) {
+            breakerCooldown = BREAKER_MAX_COOLDOWN;
+        }
+
+#ifdef KGTK_DEBUG
+
+        if (kgtkDebug & 0x01) {
+            printf("KGTK::Circuit breaker open for %ds\n", (int)((breakerOpenUntil - g_get_monotonic_time()) / G_USEC_PER_SEC));
+        }
+
+#endif
+    }
+}
+
+/* Returns FALSE if kdialogd could not be used - in which case the Gtk dialog should be shown instead */
+static gboolean openKdeDialog(GtkWidget *widget, guint32 id, const char *title, const char *p1, const char *p2,
+                              const char *p3, Operation op, GSList **res, gchar **selFilter, gchar **customRv,
+                              gboolean overWrite)
+{
+    gboolean rv,
+             retry;
 
+    if (!breakerClosed()) {
+        return FALSE;
+    }
+
+    rv = sendMessage(widget, id, op, res, selFilter, customRv, getTitle(title), p1, p2, p3, overWrite, &retry);
+
+    /* kdialogd closed an idle connection just as this request was sent - so send it again, but only once */
+    if (!rv && retry) {
+#ifdef KGTK_DEBUG
+
+        if (kgtkDebug & 0x01) {
+            printf("KGTK::Connection closed by kdialogd, resending %u\n", id);
+        }
+
+#endif
+        rv = sendMessage(widget, id, op, res, selFilter, customRv, getTitle(title), p1, p2, p3, overWrite, &retry);
+    }
+
+    breakerUpdate(rv);
     return rv;
 }
 
@@ -533,7 +987,8 @@ static gboolean kgtkInit(const char *appName)
 
         initialised = TRUE;
         kgtkAppName = getAppName(appName);
-        useKde = connectToKDialogD(kgtkAppName);
+        /* Dont connect here - see ensureConnection() - just check that there is a kdialogd to connect to */
+        useKde = 0 == access(KDIALOGD_LOCATION"/kdialogd5", X_OK);
 
         if (useKde) {
             const gchar *prg = getAppName(NULL);
@@ -600,6 +1055,7 @@ static gboolean kgtkInit(const char *appName)
                 g_thread_init(NULL);
             }
 
+            traceInit(prg ? prg : "kgtk");
             atexit(&kgtkExit);
         }
 
@@ -710,6 +1166,7 @@ typedef struct {
              cancel;
     gboolean setOverWrite,
              doOverwrite;
+    guint32  request;   /* Id of the kdialogd request currently open for this chooser, or 0 */
 } KGtkFileData;
 
 static KGtkFileData *lookupHash(void *hash, gboolean create)
@@ -739,6 +1196,7 @@ static KGtkFileData *lookupHash(void *hash, gboolean create)
         rv->cancel = GTK_RESPONSE_CANCEL;
         rv->setOverWrite = FALSE;
         rv->doOverwrite = FALSE;
+        rv->request = 0;
         g_hash_table_insert(fileDialogHash, hash, rv);
         rv = g_hash_table_lookup(fileDialogHash, hash);
     }
@@ -2075,6 +2533,49 @@ int gtk_combo_box_get_active(GtkComboBox *combo)
     return rv;
 }
 
+/*
+    Run the Gtk file chooser itself - used when kdialogd cannot be. The real dialog emits "response", and then
+    its selection is copied to where our gtk_file_chooser_get_* functions look for it.
+*/
+static gint runGtkDialog(GtkDialog *dialog, gint(*realFunction)(GtkDialog *dialog))
+{
+    static GSList *(*realGetFilenames)(GtkFileChooser *chooser) = NULL;
+    static gchar *(*realGetCurrentFolder)(GtkFileChooser *chooser) = NULL;
+
+    KGtkFileData *data;
+    gint         resp;
+
+    if (!realGetFilenames) {
+        realGetFilenames = real_dlsym(RTLD_NEXT, "gtk_file_chooser_get_filenames");
+    }
+
+    if (!realGetCurrentFolder) {
+        realGetCurrentFolder = real_dlsym(RTLD_NEXT, "gtk_file_chooser_get_current_folder");
+    }
+
+    lookupHash(dialog, TRUE);
+    resp = realFunction(dialog);
+
+    /* If the app destroyed the chooser from its response handler, then its data will have been freed */
+    if ((data = lookupHash(dialog, FALSE)) && realGetFilenames) {
+        gchar *folder = realGetCurrentFolder ? realGetCurrentFolder(GTK_FILE_CHOOSER(dialog)) : NULL;
+
+        if (data->files) {
+            g_slist_foreach(data->files, (GFunc)g_free, NULL);
+            g_slist_free(data->files);
+        }
+
+        data->files = realGetFilenames(GTK_FILE_CHOOSER(dialog));
+
+        if (folder) {
+            g_free(data->folder);
+            data->folder = folder;
+        }
+    }
+
+    return resp;
+}
+
 gint gtk_dialog_run(GtkDialog *dialog)
 {
     static gint(*realFunction)(GtkDialog * dialog) = NULL;
@@ -2092,9 +2593,9 @@ gint gtk_dialog_run(GtkDialog *dialog)
 #endif
 
     if (kgtkInit(NULL) && GTK_IS_FILE_CHOOSER(dialog)) {
-        static gboolean running = FALSE;
-
         KGtkFileData *data = lookupHash(dialog, TRUE);
+        gboolean     running = 0 != data->request ||
+                               (!(kdialogdCaps & CAP_MULTIPLEX) && havePendingRequests());
 
 #ifdef KGTK_DEBUG
 
@@ -2112,14 +2613,29 @@ gint gtk_dialog_run(GtkDialog *dialog)
             const gchar          *title = gtk_window_get_title(GTK_WINDOW(dialog));
             GString              *filter = NULL;
             GString              *custom = NULL;
-            gint                 resp = data->cancel;
+            gint                 resp = data->cancel,
+                                 okResp = data->ok;
+            guint32              id = nextRequestId();
+            gboolean             usedKde = FALSE;
+            gulong               destroyHandler;
             gboolean             origOverwrite =
                 gtk_file_chooser_get_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog));
+            char                 traceId[TRACE_ID_LEN];
+            uint64_t             start = traceNow(),
+                                 step;
+
+            requestTraceId(traceId, id);
 
-            running = TRUE;
+            /* The app may destroy the chooser whilst the KDE dialog is open - so keep it alive until we are
+               done, and dont touch 'data' after the dialog has returned */
+            g_object_ref(dialog);
+            data->request = id;
+            destroyHandler = g_signal_connect(dialog, "destroy", G_CALLBACK(chooserDestroyed), GUINT_TO_POINTER(id));
 
             if (GTK_FILE_CHOOSER_ACTION_OPEN == act || GTK_FILE_CHOOSER_ACTION_SAVE == act) {
+                step = traceNow();
                 filter = getFilters(dialog), custom = getCustomWidgets(dialog);
+                traceSpan("getFilters", traceId, step);
             } else /* GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER==act ||
                  GTK_FILE_CHOOSER_ACTION_CREATE_FOLDER==act */
                 if (NULL == (current = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog)))) {
@@ -2141,50 +2657,43 @@ gint gtk_dialog_run(GtkDialog *dialog)
                 if (gtk_file_chooser_get_select_multiple(GTK_FILE_CHOOSER(dialog))) {
                     GSList *files = NULL;
 
-                    openKdeDialog(GTK_WIDGET(dialog), title ? title : "",
-                                  data->folder ? data->folder : "",
-                                  filter && filter->len
-                                  ? filter->str
-                                  : kgtkFileFilter
-                                  ? kgtkFileFilter
-                                  : "",
-                                  custom && custom->len ? custom->str : "",
-                                  OP_FILE_OPEN_MULTIPLE, &files, &selFilter, &customRv, FALSE);
+                    usedKde = openKdeDialog(GTK_WIDGET(dialog), id, title ? title : "",
+                                            data->folder ? data->folder : "",
+                                            filter && filter->len
+                                            ? filter->str
+                                            : kgtkFileFilter
+                                            ? kgtkFileFilter
+                                            : "",
+                                            custom && custom->len ? custom->str : "",
+                                            OP_FILE_OPEN_MULTIPLE, &files, &selFilter, &customRv, FALSE);
 
                     if (files) {
-                        GSList *c;
-
-                        gtk_file_chooser_unselect_all(GTK_FILE_CHOOSER(dialog));
-
-                        for (c = files; c; c = g_slist_next(c))
-                            gtk_file_chooser_select_filename(GTK_FILE_CHOOSER(dialog),
-                                                             (gchar *)(c->data));
-
+                        selectFilenames(GTK_FILE_CHOOSER(dialog), files);
                         g_slist_foreach(files, (GFunc)g_free, NULL);
                         g_slist_free(files);
 
-                        resp = data->ok;
+                        resp = okResp;
                     }
                 } else {
                     gchar  *file = NULL;
                     GSList *res = NULL;
 
-                    openKdeDialog(GTK_WIDGET(dialog), title ? title : "",
-                                  data->folder ? data->folder : "",
-                                  filter && filter->len
-                                  ? filter->str
-                                  : kgtkFileFilter
-                                  ? kgtkFileFilter
-                                  : "",
-                                  custom && custom->len ? custom->str : "",
-                                  OP_FILE_OPEN, &res, &selFilter, &customRv, FALSE);
+                    usedKde = openKdeDialog(GTK_WIDGET(dialog), id, title ? title : "",
+                                            data->folder ? data->folder : "",
+                                            filter && filter->len
+                                            ? filter->str
+                                            : kgtkFileFilter
+                                            ? kgtkFileFilter
+                                            : "",
+                                            custom && custom->len ? custom->str : "",
+                                            OP_FILE_OPEN, &res, &selFilter, &customRv, FALSE);
                     file = firstEntry(res);
 
                     if (file) {
                         gtk_file_chooser_unselect_all(GTK_FILE_CHOOSER(dialog));
                         gtk_file_chooser_select_filename(GTK_FILE_CHOOSER(dialog), file);
                         g_free(file);
-                        resp = data->ok;
+                        resp = okResp;
                     }
                 }
 
@@ -2212,15 +2721,15 @@ gint gtk_dialog_run(GtkDialog *dialog)
                     current = g_string_free(cur, FALSE);
                 }
 
-                openKdeDialog(GTK_WIDGET(dialog), title ? title : "",
-                              current ? current : (data->folder ? data->folder : ""),
-                              filter && filter->len
-                              ? filter->str
-                              : kgtkFileFilter
-                              ? kgtkFileFilter
-                              : "",
-                              custom && custom->len ? custom->str : "",
-                              OP_FILE_SAVE, &res, &selFilter, &customRv, origOverwrite);
+                usedKde = openKdeDialog(GTK_WIDGET(dialog), id, title ? title : "",
+                                        current ? current : (data->folder ? data->folder : ""),
+                                        filter && filter->len
+                                        ? filter->str
+                                        : kgtkFileFilter
+                                        ? kgtkFileFilter
+                                        : "",
+                                        custom && custom->len ? custom->str : "",
+                                        OP_FILE_SAVE, &res, &selFilter, &customRv, origOverwrite);
                 file = firstEntry(res);
 
                 if (file) {
@@ -2236,7 +2745,7 @@ gint gtk_dialog_run(GtkDialog *dialog)
                     gtk_file_chooser_unselect_all(GTK_FILE_CHOOSER(dialog));
                     gtk_file_chooser_select_filename(GTK_FILE_CHOOSER(dialog), file);
                     g_free(file);
-                    resp = data->ok;
+                    resp = okResp;
                 }
 
                 break;
@@ -2260,20 +2769,22 @@ gint gtk_dialog_run(GtkDialog *dialog)
                 }
 
 #endif
-                openKdeDialog(GTK_WIDGET(dialog), title ? title : "",
-                              data->folder ? data->folder : "", NULL, NULL,
-                              OP_FOLDER, &res, NULL, NULL, FALSE);
+                usedKde = openKdeDialog(GTK_WIDGET(dialog), id, title ? title : "",
+                                        data->folder ? data->folder : "", NULL, NULL,
+                                        OP_FOLDER, &res, NULL, NULL, FALSE);
                 folder = firstEntry(res);
 
                 if (folder) {
                     gtk_file_chooser_select_filename(GTK_FILE_CHOOSER(dialog), folder);
                     gtk_file_chooser_set_current_folder(GTK_FILE_CHOOSER(dialog), folder);
                     g_free(folder);
-                    resp = data->ok;
+                    resp = okResp;
                 }
             }
             }
 
+            g_signal_handler_disconnect(dialog, destroyHandler);
+
             if (current) {
                 g_free(current);
             }
@@ -2286,6 +2797,8 @@ gint gtk_dialog_run(GtkDialog *dialog)
                 g_string_free(custom, TRUE);
             }
 
+            step = traceNow();
+
             if (selFilter) {
                 setFilter(selFilter, dialog);
                 g_free(selFilter);
@@ -2296,6 +2809,14 @@ gint gtk_dialog_run(GtkDialog *dialog)
                 g_free(customRv);
             }
 
+            traceSpan("setFilter", traceId, step);
+
+            if (!usedKde) {
+                /* kdialogd could not be used, so show the Gtk dialog instead */
+                kgtkFileChooserSetDoOverwriteConfirmation(GTK_FILE_CHOOSER(dialog), origOverwrite, FALSE);
+                resp = runGtkDialog(dialog, realFunction);
+            }
+
 #ifdef KGTK_DEBUG
 
             if (kgtkDebug & 0x02) {
@@ -2303,8 +2824,16 @@ gint gtk_dialog_run(GtkDialog *dialog)
             }
 
 #endif
-            g_signal_emit_by_name(dialog, "response", resp);
-            running = FALSE;
+            if ((data = lookupHash(dialog, FALSE)) && id == data->request) {
+                data->request = 0;
+            }
+
+            if (usedKde) {
+                g_signal_emit_by_name(dialog, "response", resp);
+            }
+
+            g_object_unref(dialog);
+            traceSpan("dialog", traceId, start);
             return resp;
         }
 
@@ -2319,6 +2848,10 @@ gint gtk_dialog_run(GtkDialog *dialog)
         return data->cancel;
     }
 
+    if (GTK_IS_FILE_CHOOSER(dialog)) {
+        return runGtkDialog(dialog, realFunction);
+    }
+
     return (gint)realFunction(dialog);
 }
 
@@ -2350,9 +2883,10 @@ gchar *gtk_file_chooser_get_filename(GtkFileChooser *chooser)
     return data && data->files && data->files->data ? g_strdup(data->files->data) : NULL;
 }
 
-gboolean gtk_file_chooser_select_filename(GtkFileChooser *chooser, const char *filename)
+/* 'known', if set, holds the names already in data->files - so that adding a large selection does not need
+   to search the whole list for each file */
+static void selectFilename(GtkFileChooser *chooser, KGtkFileData *data, const char *filename, GHashTable *known)
 {
-    KGtkFileData *data = lookupHash(chooser, TRUE);
     static void *(*realFunction)() = NULL;
 
     if (!realFunction) {
@@ -2369,25 +2903,54 @@ gboolean gtk_file_chooser_select_filename(GtkFileChooser *chooser, const char *f
 #endif
 
     if (data && filename) {
-        GSList *c = NULL;
+        GSList   *c = NULL;
+        gboolean found = FALSE;
 
-        for (c = data->files; c; c = g_slist_next(c))
-            if (c->data && 0 == strcmp((char *)(c->data), filename)) {
-                break;
-            }
+        if (known) {
+            found = NULL != g_hash_table_lookup(known, filename);
+        } else {
+            for (c = data->files; c && !found; c = g_slist_next(c))
+                if (c->data && 0 == strcmp((char *)(c->data), filename)) {
+                    found = TRUE;
+                }
+        }
 
-        if (!c) {
+        if (!found) {
             gchar *folder = g_path_get_dirname(filename);
 
             data->files = g_slist_prepend(data->files, g_strdup(filename));
 
+            if (known) {
+                g_hash_table_insert(known, data->files->data, data->files->data);
+            }
+
             if (folder && (!data->folder || strcmp(folder, data->folder))) {
                 gtk_file_chooser_set_current_folder(chooser, folder);
-                g_free(folder);
             }
+
+            g_free(folder);
         }
     }
+}
+
+/* Replace the chooser's selection with the list of files returned from kdialogd */
+static void selectFilenames(GtkFileChooser *chooser, GSList *files)
+{
+    KGtkFileData *data = lookupHash(chooser, TRUE);
+    GHashTable   *known = g_hash_table_new(g_str_hash, g_str_equal);
+
+    gtk_file_chooser_unselect_all(chooser);
+
+    for (; files; files = g_slist_next(files)) {
+        selectFilename(chooser, data, (gchar *)(files->data), known);
+    }
 
+    g_hash_table_destroy(known);
+}
+
+gboolean gtk_file_chooser_select_filename(GtkFileChooser *chooser, const char *filename)
+{
+    selectFilename(chooser, lookupHash(chooser, TRUE), filename, NULL);
     return TRUE;
 }
 
@@ -2729,6 +3292,10 @@ GtkWidget *gtk_file_chooser_dialog_new(const gchar *title, GtkWindow *parent,
     dlg = kgtk_file_chooser_dialog_new_valist(title, parent, action, NULL, first_button_text, varargs);
     va_end(varargs);
 
+    if (kgtkInit(NULL)) {
+        warmConnection();
+    }
+
 #ifdef KGTK_DEBUG
 
     if (kgtkDebug & 0x02) {
@@ -0,0 +1,513 @@
+/*
+ * KGtk
+ *
+ * Copyright 2006-2011 Craig Drummond <craig.p.drummond@gmail.com>
+ *
+ * ----
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+/*
+    Wire protocol between libkgtk2/libkgtk3 and kdialogd5.
+
+    After connecting, the client sends its app name (uint32 length + name), followed by a HELLO frame.
+    kdialogd replies with a WELCOME frame containing its own protocol version, and the capabilities that
+    both sides support. If the versions differ, the connection is dropped - so mismatched builds fail
+    cleanly instead of desyncing. Optional features are enabled via capability bits, and so do not require
+    a version bump.
+
+    Everything after the app name is a frame:
+
+        uint32  payload length
+        uint16  message type (MsgType)
+        uint16  flags (currently unused, must be 0)
+        uint32  request id - chosen by the client, echoed back in replies
+        ...     payload - a sequence of fields
+
+    Each field is:
+
+        uint8   tag (FieldTag)
+        uint8   type (FieldType)
+        uint32  data length
+        ...     data - strings are UTF-8, and are *not* NUL terminated
+
+    All integers are little endian. Unknown tags are skipped, so new optional fields can be added without
+    breaking older peers. A known tag with the wrong type or length is a protocol error.
+
+    If CAP_STREAM was agreed, the paths of a large selection are sent as they are resolved, in any number of
+    RESULT_PART frames, followed by the final RESULT. The client appends the paths from each part, and drops
+    them all if the final RESULT is not ACCEPTED.
+
+    If CAP_CANCEL was agreed, the client may send a CANCEL for a request that it no longer wants - e.g. as the
+    app has destroyed the file chooser. kdialogd then closes that dialog, and replies with a RESULT that is not
+    ACCEPTED, as if the user had cancelled it. So every OPEN is still answered by exactly one RESULT, and the
+    connection stays usable for the next request.
+
+    If CAP_GOODBYE was agreed, kdialogd may close a connection that has been idle for a while, so that it can
+    exit even whilst long lived apps stay open. It first sends a GOODBYE frame, and then ignores anything else
+    that it reads. It only does this when every OPEN it has read has been answered - so a client that sees
+    GOODBYE with requests still outstanding sent them too late, and may send them again on a new connection.
+
+    Any client may send STATS, once the handshake is done, and is answered with a STATS_REPLY holding a text
+    report of what kdialogd has done since it started - see `kdialogd5 --stats`. This needs no capability, as
+    libkgtk never sends it.
+
+    An OPEN may carry a TRACE_ID - a correlation id for the request, sent by an app that is tracing (see
+    trace.h). kdialogd uses it to label its own trace of the request; it is otherwise ignored.
+*/
+
+#include <stdint.h>
+#include "common.h"
+
+#define KGTK_PROTOCOL_MAGIC   0x4b47544bu /* "KGTK" */
+#define KGTK_PROTOCOL_VERSION 1
+
+/* Capability bits, exchanged in the handshake */
+#define CAP_MULTIPLEX 0x00000001u /* Several MSG_OPEN requests may be outstanding on one connection */
+#define CAP_SHM       0x00000002u /* Large path lists may be sent in a sealed memfd (see FIELD_SHARED_PATHS) */
+#define CAP_STREAM    0x00000004u /* Paths may be sent in batches, via MSG_RESULT_PART, before the MSG_RESULT */
+#define CAP_CANCEL    0x00000008u /* Outstanding requests may be cancelled, via MSG_CANCEL */
+#define CAP_GOODBYE   0x00000010u /* Idle connections may be closed by kdialogd, after a MSG_GOODBYE */
+
+#ifdef HAVE_MEMFD_CREATE
+#define KGTK_CAP_SHM CAP_SHM
+#else
+#define KGTK_CAP_SHM 0
+#endif
+
+/* Capabilities supported by this build */
+#define KGTK_CAPS (CAP_MULTIPLEX | KGTK_CAP_SHM | CAP_STREAM | CAP_CANCEL | CAP_GOODBYE)
+
+typedef enum {
+    MSG_HELLO       = 1, /* Client -> kdialogd: MAGIC, VERSION, CAPS */
+    MSG_WELCOME     = 2, /* kdialogd -> client: MAGIC, VERSION, CAPS */
+    MSG_OPEN        = 3, /* Client -> kdialogd: OPERATION, XID, TITLE, START_DIR, FILTER, CUSTOM_WIDGETS, OVERWRITE,
+                              [TRACE_ID] */
+    MSG_RESULT      = 4, /* kdialogd -> client: ACCEPTED, PATH* or SHARED_PATHS, SELECTED_FILTER, CUSTOM_RESULT */
+    MSG_RESULT_PART = 5, /* kdialogd -> client: PATH* or SHARED_PATHS - more of the result follows */
+    MSG_CANCEL      = 6, /* Client -> kdialogd: no fields - close the dialog for this request id */
+    MSG_GOODBYE     = 7, /* kdialogd -> client: no fields, id 0 - the connection was idle, and is being closed */
+    MSG_STATS       = 8, /* Client -> kdialogd: no fields */
+    MSG_STATS_REPLY = 9  /* kdialogd -> client: STATS */
+} MsgType;
+
+typedef enum {
+    FIELD_MAGIC           = 1,
+    FIELD_VERSION         = 2,
+    FIELD_CAPS            = 3,
+    FIELD_OPERATION       = 4,
+    FIELD_XID             = 5,
+    FIELD_TITLE           = 6,
+    FIELD_START_DIR       = 7,
+    FIELD_FILTER          = 8,
+    FIELD_CUSTOM_WIDGETS  = 9,
+    FIELD_OVERWRITE       = 10,
+    FIELD_ACCEPTED        = 11,
+    FIELD_PATH            = 12,
+    FIELD_SELECTED_FILTER = 13,
+    FIELD_CUSTOM_RESULT   = 14,
+    FIELD_SHARED_PATHS    = 15, /* U32 byte length of a table of PATH fields, held in the memfd passed with the frame */
+    FIELD_STATS           = 16, /* "name value" lines, one per counter */
+    FIELD_TRACE_ID        = 17  /* Correlation id of the request, for tracing */
+} FieldTag;
+
+typedef enum {
+    FIELD_TYPE_U32    = 1,
+    FIELD_TYPE_BOOL   = 2,
+    FIELD_TYPE_STRING = 3
+} FieldType;
+
+#define FRAME_HEADER_LEN 12
+#define FIELD_HEADER_LEN 6
+#define MAX_FRAME_LEN    (64 * 1024 * 1024)
+
+/* Path lists at least this large are sent via shared memory, if CAP_SHM was agreed */
+#define SHM_THRESHOLD    (64 * 1024)
+
+static void putU16(char *p, uint16_t v)
+{
+    p[0] = (char)(v & 0xff);
+    p[1] = (char)((v >> 8) & 0xff);
+}
+
+static void putU32(char *p, uint32_t v)
+{
+    p[0] = (char)(v & 0xff);
+    p[1] = (char)((v >> 8) & 0xff);
+    p[2] = (char)((v >> 16) & 0xff);
+    p[3] = (char)((v >> 24) & 0xff);
+}
+
+static uint16_t getU16(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+
+    return (uint16_t)(u[0] | (u[1] << 8));
+}
+
+static uint32_t getU32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+
+    return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+/* Growable output buffer. 'error' is set if an allocation fails, in which case further appends are ignored */
+typedef struct {
+    char   *data;
+    size_t len,
+           size;
+    int    error;
+} Buffer;
+
+static void initBuffer(Buffer *b)
+{
+    b->data = NULL;
+    b->len = b->size = 0;
+    b->error = 0;
+}
+
+static void freeBuffer(Buffer *b)
+{
+    free(b->data);
+    initBuffer(b);
+}
+
+static int reserveBuffer(Buffer *b, size_t extra)
+{
+    if (b->error) {
+        return 0;
+    }
+
+    if (b->len + extra > b->size) {
+        size_t newSize = b->size ? b->size : 256;
+        char   *newData;
+
+        while (newSize < b->len + extra) {
+            newSize *= 2;
+        }
+
+        if (!(newData = (char *)realloc(b->data, newSize))) {
+            b->error = 1;
+            return 0;
+        }
+
+        b->data = newData;
+        b->size = newSize;
+    }
+
+    return 1;
+}
+
+static void appendBuffer(Buffer *b, const void *data, size_t len)
+{
+    if (reserveBuffer(b, len)) {
+        memcpy(&b->data[b->len], data, len);
+        b->len += len;
+    }
+}
+
+/* Start a frame, returns the offset of its header - which must be passed to endFrame() */
+static size_t beginFrame(Buffer *b, MsgType type, uint32_t id)
+{
+    size_t frame = b->len;
+
+    if (reserveBuffer(b, FRAME_HEADER_LEN)) {
+        char *hdr = &b->data[b->len];
+
+        putU32(hdr, 0);
+        putU16(&hdr[4], (uint16_t)type);
+        putU16(&hdr[6], 0);
+        putU32(&hdr[8], id);
+        b->len += FRAME_HEADER_LEN;
+    }
+
+    return frame;
+}
+
+static void endFrame(Buffer *b, size_t frame)
+{
+    if (!b->error) {
+        if (b->len - frame - FRAME_HEADER_LEN > MAX_FRAME_LEN) {
+            b->error = 1;
+        } else {
+            putU32(&b->data[frame], (uint32_t)(b->len - frame - FRAME_HEADER_LEN));
+        }
+    }
+}
+
+static void addField(Buffer *b, FieldTag tag, FieldType type, const void *data, size_t len)
+{
+    if (reserveBuffer(b, FIELD_HEADER_LEN + len)) {
+        char *hdr = &b->data[b->len];
+
+        hdr[0] = (char)tag;
+        hdr[1] = (char)type;
+        putU32(&hdr[2], (uint32_t)len);
+        b->len += FIELD_HEADER_LEN;
+        appendBuffer(b, data, len);
+    }
+}
+
+static void addU32Field(Buffer *b, FieldTag tag, uint32_t v)
+{
+    char data[4];
+
+    putU32(data, v);
+    addField(b, tag, FIELD_TYPE_U32, data, 4);
+}
+
+static void addBoolField(Buffer *b, FieldTag tag, int v)
+{
+    char data = v ? 1 : 0;
+
+    addField(b, tag, FIELD_TYPE_BOOL, &data, 1);
+}
+
+static void addStringField(Buffer *b, FieldTag tag, const char *str, size_t len)
+{
+    addField(b, tag, FIELD_TYPE_STRING, str, len);
+}
+
+/* Write the buffer in one go. If passFd is not -1, it is sent along with the data */
+static int writeBufferFd(int fd, const Buffer *b, int passFd)
+{
+    struct iovec iov;
+
+    if (b->error) {
+        return 0;
+    }
+
+    iov.iov_base = b->data;
+    iov.iov_len = b->len;
+    return writeBlockVFd(fd, &iov, 1, passFd);
+}
+
+static int writeBuffer(int fd, const Buffer *b)
+{
+    return writeBufferFd(fd, b, -1);
+}
+
+typedef struct {
+    uint32_t length;
+    uint16_t type,
+             flags;
+    uint32_t id;
+} FrameHeader;
+
+static int parseFrameHeader(const char *data, FrameHeader *h)
+{
+    h->length = getU32(data);
+    h->type = getU16(&data[4]);
+    h->flags = getU16(&data[6]);
+    h->id = getU32(&data[8]);
+
+    return h->length <= MAX_FRAME_LEN && 0 == h->flags;
+}
+
+/* Read a complete frame - the payload is placed into 'payload', replacing any previous contents */
+static int readFrame(ReadBuffer *in, FrameHeader *h, Buffer *payload)
+{
+    char hdr[FRAME_HEADER_LEN];
+
+    if (!readBuffered(in, hdr, FRAME_HEADER_LEN) || !parseFrameHeader(hdr, h)) {
+        return 0;
+    }
+
+    payload->len = 0;
+
+    if (!reserveBuffer(payload, h->length) || !readBuffered(in, payload->data, h->length)) {
+        return 0;
+    }
+
+    payload->len = h->length;
+    return 1;
+}
+
+/*
+    For non-blocking readers: returns 1 if a complete frame is buffered - so that readFrame() will not need
+    to read from the fd - 0 if more data is needed, and -1 if the buffered header is invalid, or announces a
+    payload longer than 'maxLen'. This is checked before any of the payload is waited for, so a reader never
+    has to buffer more than 'maxLen' for a frame.
+*/
+static inline int frameBuffered(const ReadBuffer *in, uint32_t maxLen)
+{
+    FrameHeader h;
+
+    if (bufferedBytes(in) < FRAME_HEADER_LEN) {
+        return 0;
+    }
+
+    if (!parseFrameHeader(&in->data[in->start], &h) || h.length > maxLen) {
+        return -1;
+    }
+
+    return bufferedBytes(in) - FRAME_HEADER_LEN >= h.length ? 1 : 0;
+}
+
+typedef struct {
+    FieldTag    tag;
+    FieldType   type;
+    uint32_t    length;
+    const char *data;
+} Field;
+
+typedef struct {
+    const char *pos,
+               *end;
+} FieldIter;
+
+static void initFieldIter(FieldIter *it, const char *data, size_t len)
+{
+    it->pos = data;
+    it->end = data + len;
+}
+
+/* Returns 1 if a field was read, 0 at the end of the payload, and -1 if the payload is malformed */
+static int nextField(FieldIter *it, Field *f)
+{
+    size_t left = it->end - it->pos;
+
+    if (0 == left) {
+        return 0;
+    }
+
+    if (left < FIELD_HEADER_LEN) {
+        return -1;
+    }
+
+    f->tag = (FieldTag)(unsigned char)it->pos[0];
+    f->type = (FieldType)(unsigned char)it->pos[1];
+    f->length = getU32(&it->pos[2]);
+
+    if (f->length > left - FIELD_HEADER_LEN) {
+        return -1;
+    }
+
+    f->data = &it->pos[FIELD_HEADER_LEN];
+    it->pos += FIELD_HEADER_LEN + f->length;
+
+    switch (f->type) {
+    case FIELD_TYPE_U32:
+        return 4 == f->length ? 1 : -1;
+
+    case FIELD_TYPE_BOOL:
+        return 1 == f->length ? 1 : -1;
+
+    default:
+        return 1;
+    }
+}
+
+/* Field accessors - these check that a known tag has the expected type */
+static int fieldU32(const Field *f, uint32_t *v)
+{
+    if (FIELD_TYPE_U32 != f->type) {
+        return 0;
+    }
+
+    *v = getU32(f->data);
+    return 1;
+}
+
+static int fieldBool(const Field *f, int *v)
+{
+    if (FIELD_TYPE_BOOL != f->type) {
+        return 0;
+    }
+
+    *v = f->data[0] ? 1 : 0;
+    return 1;
+}
+
+static int fieldIsString(const Field *f)
+{
+    return FIELD_TYPE_STRING == f->type;
+}
+
+/* Handshake frames, sent by both sides */
+static void addHandshake(Buffer *b, MsgType type, uint32_t caps)
+{
+    size_t frame = beginFrame(b, type, 0);
+
+    addU32Field(b, FIELD_MAGIC, KGTK_PROTOCOL_MAGIC);
+    addU32Field(b, FIELD_VERSION, KGTK_PROTOCOL_VERSION);
+    addU32Field(b, FIELD_CAPS, caps);
+    endFrame(b, frame);
+}
+
+static int writeHandshake(int fd, MsgType type, uint32_t caps)
+{
+    Buffer b;
+    int    rv;
+
+    initBuffer(&b);
+    addHandshake(&b, type, caps);
+    rv = writeBuffer(fd, &b);
+    freeBuffer(&b);
+    return rv;
+}
+
+/* Read a HELLO/WELCOME frame. Returns 1 if it is valid, and the peer speaks our protocol version */
+static int readHandshake(ReadBuffer *in, MsgType type, uint32_t *version, uint32_t *caps)
+{
+    FrameHeader h;
+    Buffer      payload;
+    FieldIter   it;
+    Field       f;
+    uint32_t    magic = 0;
+    int         rv = 0,
+                ok = 1;
+
+    *version = 0;
+    *caps = 0;
+    initBuffer(&payload);
+
+    if (!readFrame(in, &h, &payload) || type != h.type) {
+        freeBuffer(&payload);
+        return 0;
+    }
+
+    initFieldIter(&it, payload.data, payload.len);
+
+    while (ok && (rv = nextField(&it, &f)) > 0) {
+        switch (f.tag) {
+        case FIELD_MAGIC:
+            ok = fieldU32(&f, &magic);
+            break;
+
+        case FIELD_VERSION:
+            ok = fieldU32(&f, version);
+            break;
+
+        case FIELD_CAPS:
+            ok = fieldU32(&f, caps);
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    freeBuffer(&payload);
+    return ok && 0 == rv && KGTK_PROTOCOL_MAGIC == magic && KGTK_PROTOCOL_VERSION == *version;
+}
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ * KGtk
+ *
+ * Copyright 2006-2011 Craig Drummond <craig.p.drummond@gmail.com>
+ *
+ * ----
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/*
+    Opt-in request tracing, shared by libkgtk and kdialogd5.
+
+    If KGTK_TRACE names a folder, each process writes the spans of the requests that it handles to
+    <folder>/kgtk-trace-<name>-<pid>.json, in Chrome's trace event format. Each request carries a correlation id
+    (FIELD_TRACE_ID) from the app to kdialogd and back, and flow events link the two sides - so the files of an
+    app and of kdialogd can be merged (e.g. "jq -s add kgtk-trace-*.json") into one timeline, for
+    chrome://tracing or Perfetto. Timestamps are from CLOCK_MONOTONIC, so that they agree across processes.
+
+    Each event is a single write() to a file opened with O_APPEND, so any thread may trace without locking.
+    The array is closed at exit - a process that crashed leaves it open, which the viewers accept.
+*/
+
+#include <stdint.h>
+#include <sys/syscall.h>
+#include "common.h"
+
+#define TRACE_ID_LEN    32   /* Longest correlation id, with its NUL */
+#define TRACE_EVENT_LEN 512
+
+static int  traceFd = -1;
+static int  tracePid = 0;
+static char traceName[64];
+
+/* Names, and correlation ids (which come from the other side), are written out without escaping - so only
+   their safe characters are kept */
+static void traceCopy(char *dest, size_t size, const char *src)
+{
+    size_t i = 0;
+
+    for (; src && *src && i < size - 1; ++src) {
+        if ((*src >= '0' && *src <= '9') || (*src >= 'a' && *src <= 'z') || (*src >= 'A' && *src <= 'Z') ||
+                '-' == *src || '_' == *src || '.' == *src) {
+            dest[i++] = *src;
+        }
+    }
+
+    dest[i] = '\0';
+}
+
+static void traceClose()
+{
+    if (traceFd >= 0) {
+        char event[TRACE_EVENT_LEN];
+        int  len = snprintf(event, sizeof(event),
+                            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}\n]\n",
+                            tracePid, traceName);
+
+        if (len > 0 && len < (int)sizeof(event) && write(traceFd, event, len) < 0) {
+            /* Nothing to be done */
+        }
+
+        close(traceFd);
+        traceFd = -1;
+    }
+}
+
+/* Start tracing, if KGTK_TRACE is set. 'name' names this process in the trace, and its file */
+static void traceInit(const char *name)
+{
+    const char *dir = getenv("KGTK_TRACE");
+    char       path[PATH_MAX];
+
+    if (traceFd >= 0 || !dir || !dir[0]) {
+        return;
+    }
+
+    tracePid = getpid();
+    traceCopy(traceName, sizeof(traceName), name);
+
+    if (snprintf(path, sizeof(path), "%s/kgtk-trace-%s-%d.json", dir, traceName, tracePid) >= (int)sizeof(path)) {
+        return;
+    }
+
+    traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+
+    if (traceFd >= 0) {
+        if (write(traceFd, "[\n", 2) < 0) {
+            close(traceFd);
+            traceFd = -1;
+            return;
+        }
+
+        atexit(traceClose);
+    }
+}
+
+static int tracing()
+{
+    return traceFd >= 0;
+}
+
+/* Microseconds, as the trace's timestamps are */
+static uint64_t traceNow()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void traceWrite(const char *event, int len)
+{
+    if (len > 0 && len < TRACE_EVENT_LEN && write(traceFd, event, len) < 0) {
+        /* Nothing to be done - tracing must not affect the request */
+    }
+}
+
+/* A span, from 'start' until now. 'id' is the request's correlation id, or NULL if it is not for one request */
+static void traceSpan(const char *name, const char *id, uint64_t start)
+{
+    if (tracing()) {
+        char     event[TRACE_EVENT_LEN],
+                 safeId[TRACE_ID_LEN];
+        uint64_t now = traceNow();
+
+        traceCopy(safeId, sizeof(safeId), id);
+        traceWrite(event, snprintf(event, sizeof(event),
+                                   "{\"name\":\"%s\",\"cat\":\"kgtk\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+                                   "\"pid\":%d,\"tid\":%d,\"args\":{\"id\":\"%s\"}},\n",
+                                   name, (unsigned long long)start, (unsigned long long)(now - start),
+                                   tracePid, (int)syscall(SYS_gettid), safeId));
+    }
+}
+
+/* One end of an arrow between processes - 'begin' at the sender, and the other end at the receiver. Each must be
+   at a time within a span on the same thread, which is what they are drawn from, and to. The request's arrows
+   share its id, so each is put in a category of its own name to keep them apart */
+static void traceFlow(const char *name, const char *id, int begin, uint64_t ts)
+{
+    if (tracing() && id && id[0]) {
+        char event[TRACE_EVENT_LEN],
+             safeId[TRACE_ID_LEN];
+
+        traceCopy(safeId, sizeof(safeId), id);
+        traceWrite(event, snprintf(event, sizeof(event),
+                                   "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"id\":\"%s\",\"ts\":%llu,"
+                                   "\"pid\":%d,\"tid\":%d%s},\n",
+                                   name, name, begin ? 's' : 'f', safeId, (unsigned long long)ts, tracePid,
+                                   (int)syscall(SYS_gettid), begin ? "" : ",\"bp\":\"e\""));
+    }
+}
+
+#endif
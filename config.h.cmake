@@ -1,6 +1,9 @@
 /* Define to 1 if you have the `getpeereid' function. */
 #cmakedefine HAVE_GETPEEREID 1
 
+/* Define to 1 if you have the `memfd_create' function. */
+#cmakedefine HAVE_MEMFD_CREATE 1
+
 /* Define if you have the struct ucred */
 #cmakedefine HAVE_STRUCT_UCRED 1
 #cmakedefine HAVE_DLVSYM 1
@@ -24,15 +24,19 @@
 #define USE_KWIN
 
 #include "kdialogd.h"
+#include "trace.h"
 #include <iostream>
 #include <kaboutdata.h>
 #include <qapplication.h>
-#include <QtCore/QSocketNotifier>
 #include <QX11Info>
 #include <QBoxLayout>
 #include <QCheckBox>
 #include <QUrl>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QPixmapCache>
 #include <kio/statjob.h>
+#include <kcoredirlister.h>
 #include <kjobwidgets.h>
 #include <kmessagebox.h>
 #include <klocalizedstring.h>
@@ -48,8 +52,19 @@
 #endif
 #include <sys/un.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/errno.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <fcntl.h>
 #include <qdebug.h>
 #ifdef KDIALOGD_APP
 #include <QTimer>
@@ -57,29 +72,170 @@
 #include <kdbusservice.h>
 #endif
 #include <fstream>
+#include <functional>
 
-KConfig *KDialogD::theirConfig = NULL;
+KConfig              *KDialogD::theirConfig = NULL;
+KDialogDConfigWriter *KDialogD::theirConfigWriter = NULL;
+KDialogDPool         *KDialogD::theirPool = NULL;
+KDialogDDirCache     *KDialogD::theirDirCache = NULL;
+KDialogDFilterCache  *KDialogD::theirFilterCache = NULL;
+KDialogDStats        KDialogD::theirStats;
 
+#define CFG_FILE_NAME       "kdialogd5rc"
 #define CFG_KEY_DIALOG_SIZE "KDialogDSize"
 #define CFG_KEY_URLS        "Urls"
 #define CFG_TIMEOUT_GROUP   "General"
 #ifdef KDIALOGD_APP
 #define CFG_TIMEOUT_KEY     "Timeout"
 #define DEFAULT_TIMEOUT     30
+#define CFG_IDLE_TARGET_KEY "IdleMemoryTarget"
+#define DEFAULT_IDLE_TARGET 0
 #endif
+#define CFG_IDLE_KEY        "IdleConnectionTimeout"
+#define DEFAULT_IDLE        (10 * 60)
+#define CFG_POOL_KEY        "DialogPool"
+#define DEFAULT_POOL        1
+#define CFG_DIR_CACHE_KEY   "DirCacheItems"
+#define DEFAULT_DIR_CACHE   20000
+#define MAX_CACHED_DIRS     32
+#define MAX_CACHED_FILTERS  16
 
 static QString groupName(const QString &app, bool fileDialog = true)
 {
     return QString(fileDialog ? "KFileDialog " : "KDirSelectDialog ") + app;
 }
 
+static QUrl resolveStartDir(const QString &startDir)
+{
+    return QUrl(startDir.isEmpty() || "~" == startDir ? QDir::homePath() : startDir);
+}
+
 Q_LOGGING_CATEGORY(kdialogd, "kgtk.kdialogd")
 
 // from kdebase/kdesu
 typedef unsigned ksocklen_t;
 
-static int createSocket()
+// Connections that the kernel may queue for us. When a session is restored, many apps may connect at once - and
+// with too small a backlog most of them would have to wait, and retry.
+#define DEFAULT_LISTEN_BACKLOG 64
+
+static int listenBacklog()
+{
+    static int backlog = 0;
+
+    if (!backlog) {
+        const char *val = getenv("KGTK_LISTEN_BACKLOG");
+
+        backlog = val && val[0] ? atoi(val) : 0;
+
+        if (backlog <= 0) {
+            backlog = DEFAULT_LISTEN_BACKLOG;
+        }
+    }
+
+    return backlog;
+}
+
+#ifdef KGTK_ABSTRACT_SOCKET
+// Returns the listening socket, -1 on error, or -2 if another kdialogd already serves this user and display
+static int createAbstractSocket()
+{
+    struct sockaddr_un addr;
+    socklen_t          addrlen = getAbstractSockAddr(&addr);
+    int                socketFd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (socketFd < 0) {
+        qCWarning(kdialogd) << "socket(): " << strerror(errno);
+        return -1;
+    }
+
+    if (0 == bind(socketFd, (struct sockaddr *)&addr, addrlen) && 0 == listen(socketFd, listenBacklog())) {
+        return socketFd;
+    }
+
+    int err = errno;
+
+    ::close(socketFd);
+
+    if (EADDRINUSE == err) {
+        // Anyone can bind an abstract name - so only give up if it really is one of ours
+        int  fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool ours = fd >= 0 && 0 == ::connect(fd, (struct sockaddr *)&addr, addrlen) && peerIsUs(fd, NULL);
+
+        if (fd >= 0) {
+            ::close(fd);
+        }
+
+        if (ours) {
+            qCWarning(kdialogd) << "kdialogd is already running";
+            return -2;
+        }
+
+        qCWarning(kdialogd) << "Abstract socket is in use by another user, falling back to" << getSockName();
+    } else {
+        qCWarning(kdialogd) << "bind(): " << strerror(err);
+    }
+
+    return -1;
+}
+#endif
+
+// Socket activation - a launcher, or supervisor, may bind the socket and pass it to us as fd 3, as per the
+// LISTEN_FDS/LISTEN_PID convention. Returns -1 if no (usable) socket was passed.
+#define LISTEN_FDS_START 3
+
+static int inheritedSocket(bool &abstract)
 {
+    const char *pid = getenv("LISTEN_PID"),
+               *fds = getenv("LISTEN_FDS");
+    int        fd = -1;
+
+    if (pid && fds && atoi(pid) == getpid() && atoi(fds) >= 1) {
+        struct sockaddr_un addr;
+        socklen_t          addrlen = sizeof(addr);
+        int                listening = 0;
+        socklen_t          len = sizeof(listening);
+
+        if (0 == getsockopt(LISTEN_FDS_START, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) && listening &&
+                0 == getsockname(LISTEN_FDS_START, (struct sockaddr *)&addr, &addrlen) &&
+                AF_UNIX == addr.sun_family) {
+            fd = LISTEN_FDS_START;
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            abstract = addrlen > offsetof(struct sockaddr_un, sun_path) && 0 == addr.sun_path[0];
+            qCDebug(kdialogd) << "Using inherited socket, abstract:" << abstract;
+        } else {
+            qCWarning(kdialogd) << "Ignoring LISTEN_FDS - fd" << LISTEN_FDS_START << "is not a listening unix socket";
+        }
+    }
+
+    // Dont pass these on to anything we start
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    return fd;
+}
+
+static int createSocket(bool &abstract)
+{
+    int inheritedFd = inheritedSocket(abstract);
+
+    if (-1 != inheritedFd) {
+        return inheritedFd;
+    }
+
+#ifdef KGTK_ABSTRACT_SOCKET
+    int abstractFd = createAbstractSocket();
+
+    abstract = abstractFd >= 0;
+
+    if (-1 != abstractFd) {
+        return abstractFd;
+    }
+
+#else
+    abstract = false;
+#endif
+
     int         socketFd;
     ksocklen_t  addrlen;
     struct stat s;
@@ -154,7 +310,7 @@ static int createSocket()
 
     chmod(sock, 0600);
 
-    if (listen(socketFd, 1) < 0) {
+    if (listen(socketFd, listenBacklog()) < 0) {
         qCritical() << "listen(): " << strerror(errno);
         return -1;
     }
@@ -162,487 +318,2153 @@ static int createSocket()
     return socketFd;
 }
 
-static QStringList urls2Local(const QList<QUrl> &urls, QWidget *parent)
-{
-    QStringList items;
-
-    foreach (const QUrl &url, urls) {
-        qCDebug(kdialogd) << "URL" << url << " local? " << url.isLocalFile();
-
-        if (url.isLocalFile()) {
-            items.append(url.path());
-        } else {
-            KIO::StatJob *job = KIO::mostLocalUrl(url);
-            KJobWidgets::setWindow(job, parent);
-            job->exec();
-            const QUrl localUrl = job->mostLocalUrl();
-            qCDebug(kdialogd) << "mostLocal" << localUrl << "local?" << localUrl.isLocalFile();
-
-            if (localUrl.isLocalFile()) {
-                items.append(localUrl.path());
-            } else {
-                break;
-            }
-        }
-    }
-
-    return items;
-}
-
-KDialogD::KDialogD(QObject *parent)
-    : QObject(parent),
-#ifdef KDIALOGD_APP
-      itsTimer(NULL),
-      itsTimeoutVal(DEFAULT_TIMEOUT),
-#endif
-      itsFd(::createSocket()),
-      itsNumConnections(0)
-{
-    if (itsFd < 0) {
-        qCritical() << "KDialogD could not create socket";
-#ifdef KDIALOGD_APP
-        QCoreApplication::exit(1);
-#endif
-    } else {
-        std::ofstream f(getPidFileName());
-
-        if (f) {
-            f << getpid();
-            f.close();
-        }
-
-        if (!theirConfig) {
-            theirConfig = new KConfig("kdialogd5rc");    // , KConfig::OnlyLocal);
-        }
+// Resolved items are passed on in batches of at most this many, or as often as this - so that the client
+// can start on a large selection before all of it has been resolved.
+#define RESOLVE_BATCH_SIZE  512
+#define RESOLVE_BATCH_MSECS 100
 
-        connect(new QSocketNotifier(itsFd, QSocketNotifier::Read, this),
-                SIGNAL(activated(int)), this, SLOT(newConnection()));
+// Most KIO::mostLocalUrl jobs to run at once, for one selection
+#define RESOLVE_MAX_JOBS    8
 
-#ifdef KDIALOGD_APP
+// Remote folders whose mount point is remembered, and for how long - mounts can come and go
+#define RESOLVED_DIRS_MAX   64
+#define RESOLVED_DIRS_MSECS (60 * 1000)
 
-        if (theirConfig->hasGroup(CFG_TIMEOUT_GROUP)) {
-            itsTimeoutVal = KConfigGroup(theirConfig, CFG_TIMEOUT_GROUP).readEntry(CFG_TIMEOUT_KEY, DEFAULT_TIMEOUT);
+// Dialog property holding the correlation id of its request, so that the resolver can label its span
+#define TRACE_ID_PROPERTY   "kgtkTraceId"
 
-            if (itsTimeoutVal < 0) {
-                itsTimeoutVal = DEFAULT_TIMEOUT;
-            }
-        }
+QList<KDialogDUrlResolver::ResolvedDir> KDialogDUrlResolver::theirResolvedDirs;
 
-        qCDebug(kdialogd) << "Timeout:" << itsTimeoutVal;
+// Whether there is anything at 'path' - a dangling symlink counts, as saving there would replace it. Just the
+// type is asked for, so this does not wait on the size, times, etc., of a file on a network filesystem.
+static bool localFileExists(const QString &path)
+{
+    QByteArray name(QFile::encodeName(path));
 
-        if (itsTimeoutVal) {
-            connect(itsTimer = new QTimer(this), SIGNAL(timeout()), this, SLOT(timeout()));
-            itsTimer->setSingleShot(true);
-        }
+#ifdef STATX_TYPE
+    struct statx sx;
 
-#endif
+    if (0 == statx(AT_FDCWD, name.constData(), AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_TYPE, &sx)) {
+        return true;
     }
-}
 
-KDialogD::~KDialogD()
-{
-    if (-1 != itsFd) {
-        close(itsFd);
+    if (ENOSYS != errno) {
+        return false;
     }
+#endif
 
-    if (theirConfig) {
-        delete theirConfig;
-    }
+    struct stat s;
 
-    theirConfig = NULL;
+    return 0 == lstat(name.constData(), &s);
 }
 
-void KDialogD::newConnection()
+static QUrl parentUrl(const QUrl &url)
 {
-    qCDebug(kdialogd) << "New connection";
+    return url.adjusted(QUrl::RemoveFilename | QUrl::StripTrailingSlash);
+}
 
-    ksocklen_t         addrlen = 64;
-    struct sockaddr_un clientname;
-    int                connectedFD;
+KDialogDUrlResolver::KDialogDUrlResolver(const QList<QUrl> &urls, QWidget *window, bool batched, QObject *parent)
+    : QObject(parent),
+      itsUrls(urls),
+      itsPaths(urls.count()),
+      itsWindow(window),
+      itsBatched(batched),
+      itsFinished(false),
+      itsNext(0),
+      itsDone(0),
+      itsTraceStart(0),
+      itsUsedKio(false)
+{
+}
 
-    if ((connectedFD =::accept(itsFd, (struct sockaddr *) &clientname, &addrlen)) >= 0) {
-        int appNameLen;
+KDialogDUrlResolver::~KDialogDUrlResolver()
+{
+    // Our parent may be part way through being destroyed, so just stop the jobs
+    itsFinished = true;
+    killJobs();
+}
 
-        if (readBlock(connectedFD, (char *)&appNameLen, 4)) {
-            bool     ok = true;
-            QByteArray appName;
+void KDialogDUrlResolver::start()
+{
+    itsTimer.start();
+    itsStarted.start();
+    itsTraceStart = traceNow();
+    startJobs();
+}
 
-            if (0 == appNameLen) {
-                appName = "Generic";
-            } else {
-                appName.resize(appNameLen);
-                ok = readBlock(connectedFD, appName.data(), appNameLen);
-            }
+void KDialogDUrlResolver::kill()
+{
+    finish(false);
+}
 
-            if (ok) {
-                itsNumConnections++;
-                qCDebug(kdialogd) << "now have" << itsNumConnections << "connections";
-#ifdef KDIALOGD_APP
+QStringList KDialogDUrlResolver::takeItems()
+{
+    QStringList items;
 
-                if (itsTimer) {
-                    itsTimer->stop();
-                }
+    items.swap(itsItems);
+    return items;
+}
 
-#endif
-                connect(new KDialogDClient(connectedFD, appName, this),
-                        SIGNAL(error(KDialogDClient *)),
-                        this, SLOT(deleteConnection(KDialogDClient *)));
-            }
-        }
-    }
+void KDialogDUrlResolver::clearResolvedDirs()
+{
+    theirResolvedDirs.clear();
 }
 
-void KDialogD::deleteConnection(KDialogDClient *client)
+// Local urls need no resolving, and nor do those in a remote folder that we recently found the mount point of.
+// The mapped path is checked, in case the folder has since been unmounted - or was not what it seemed.
+bool KDialogDUrlResolver::fromCache(int index)
 {
-    qCDebug(kdialogd) << "Delete client";
-    client->deleteLater();
+    const QUrl &url = itsUrls.at(index);
 
-#ifdef KDIALOGD_APP
+    if (url.isLocalFile()) {
+        itsPaths[index] = url.path();
+        return true;
+    }
 
-    if (0 == --itsNumConnections) {
-        qCDebug(kdialogd) << "no connections, starting timer";
+    QUrl dir(parentUrl(url));
 
-        if (itsTimeoutVal) {
-            itsTimer->start(itsTimeoutVal * 1000);    // Only single shot...
-        } else {
-            timeout();
+    for (int i = 0; i < theirResolvedDirs.count(); ++i) {
+        if (theirResolvedDirs.at(i).age.elapsed() > RESOLVED_DIRS_MSECS) {
+            // Entries are in the order that they were added, so the rest are older still
+            theirResolvedDirs.erase(theirResolvedDirs.begin() + i, theirResolvedDirs.end());
+            break;
         }
-    } else {
-        qCDebug(kdialogd) << "still have" << itsNumConnections << "connections";
-    }
 
-#endif
-}
+        if (theirResolvedDirs.at(i).dir == dir) {
+            QString path(theirResolvedDirs.at(i).path + '/' + url.fileName());
 
-void KDialogD::timeout()
-{
-#ifdef KDIALOGD_APP
+            if (!localFileExists(path)) {
+                return false;
+            }
 
-    if (0 == itsNumConnections) {
-        if (grabLock(0) > 0) { // 0=> no wait...
-            qCDebug(kdialogd) << "Timeout and no connections, so exit";
-            QCoreApplication::exit(0);
-        } else { //...unlock lock file...
-            qCDebug(kdialogd) << "Timeout, but unable to grab lock file - app must be connecting";
-            releaseLock();
+            KDialogD::stats().resolvedDirs.hits++;
+            itsPaths[index] = path;
+            return true;
         }
     }
 
-#endif
+    return false;
 }
 
-KDialogDClient::KDialogDClient(int sock, const QString &an, QObject *parent)
-    : QObject(parent),
-      itsFd(sock),
-      itsDlg(NULL),
-      itsXid(0),
-      itsAccepted(false),
-      itsAppName(an)
+// Whether 'url' was found at 'localUrl' as its folder is mounted there, e.g. by kio-fuse - so that its siblings
+// are there too. Not so for virtual folders (recentlyused:/, timeline:/, baloosearch:/, tags:/, trash:/...),
+// whose files are each in a folder of their own, and which do not have the folder's path.
+static bool mirrorsFolder(const QUrl &url, const QUrl &localUrl)
 {
-    qCDebug(kdialogd) << "new client..." << itsAppName << " (" << itsFd << ")";
-    connect(new QSocketNotifier(itsFd, QSocketNotifier::Read, this), SIGNAL(activated(int)), this, SLOT(read()));
-    connect(new QSocketNotifier(itsFd, QSocketNotifier::Exception, this), SIGNAL(activated(int)), this, SLOT(close()));
+    QString dirPath(parentUrl(url).path()),
+            localDirPath(parentUrl(localUrl).path());
+
+    return !url.fileName().isEmpty() && url.fileName() == localUrl.fileName() &&
+           dirPath.length() > 1 && localDirPath.endsWith(dirPath);
 }
 
-KDialogDClient::~KDialogDClient()
+void KDialogDUrlResolver::startJobs()
 {
-    qCDebug(kdialogd) << "Deleted client" << itsAppName;
-
-    if (-1 != itsFd) {
-        ::close(itsFd);
-    }
-
-    itsDlg = NULL;
+    while (!itsFinished && itsNext < itsUrls.count()) {
+        if (fromCache(itsNext)) {
+            itsNext++;
+            continue;
+        }
 
-    if (KDialogD::config()) {
-        KDialogD::config()->sync();
-    }
-}
+        if (itsJobs.count() >= RESOLVE_MAX_JOBS) {
+            break;
+        }
 
-void KDialogDClient::close()
-{
-    qCDebug(kdialogd) << "close" << itsFd;
+        KIO::StatJob *job = KIO::mostLocalUrl(itsUrls.at(itsNext));
 
-    if (itsDlg) {
-        itsDlg->close();
-        itsDlg->deleteLater();
-        itsDlg = NULL;
-        itsXid = 0;
+        qCDebug(kdialogd) << "Resolving" << itsUrls.at(itsNext);
+        KDialogD::stats().resolvedDirs.misses++;
+        itsUsedKio = true;
+        KJobWidgets::setWindow(job, itsWindow);
+        connect(job, SIGNAL(result(KJob *)), this, SLOT(jobResult(KJob *)));
+        itsJobs.insert(job, itsNext++);
     }
 
-    if (itsFd != -1) {
-        ::close(itsFd);
-        itsFd = -1;
-        emit error(this);
-    }
+    passOn();
 }
 
-void KDialogDClient::read()
+void KDialogDUrlResolver::jobResult(KJob *job)
 {
-    qCDebug(kdialogd) << "read" << itsFd;
+    int index = itsJobs.take(job);
 
-    if (-1 == itsFd) {
+    if (itsFinished) {
         return;
     }
 
-    char         request;
-    QString      caption;
+    const QUrl &url = itsUrls.at(index);
+    QUrl       localUrl = static_cast<KIO::StatJob *>(job)->mostLocalUrl();
 
-    if (!itsDlg && readData(&request, 1) && request >= (char)OP_FILE_OPEN && request <= (char)OP_FOLDER &&
-            readData((char *)&itsXid, 4) && readString(caption)) {
-        if ("." == caption)
-            switch ((Operation)request) {
-            case OP_FILE_OPEN:
-            case OP_FILE_OPEN_MULTIPLE:
-                caption = i18n("Open");
-                break;
-
-            case OP_FILE_SAVE:
-                caption = i18n("Save As");
-                break;
-
-            case OP_FOLDER:
-                caption = i18n("Select Folder");
-                break;
+    qCDebug(kdialogd) << "mostLocal" << localUrl << "local?" << localUrl.isLocalFile();
 
-            default:
-                break;
-            }
+    if (KJob::KilledJobError == job->error() || !localUrl.isLocalFile()) {
+        finish(false);
+        return;
+    }
 
-        if (OP_FOLDER == (Operation)request) {
-            QString intialFolder;
+    itsPaths[index] = localUrl.path();
 
-            if (readString(intialFolder)) {
-                initDialog(caption, new KDialogDDirSelectDialog(itsAppName, intialFolder, true, 0L));
-                return;
-            }
-        } else {
-            QString intialFolder,
-                    filter,
-                    customWidgets;
-            char    overW = 0;
-
-            if (readString(intialFolder) && readString(filter) && readString(customWidgets) &&
-                    (OP_FILE_SAVE != (Operation)request || readData(&overW, 1))) {
-                // LibreOffice has some "/" chars in its filternames - this seems to mess KFileDialog up, and we
-                // get blank names! So, foreach filtername we need to replace "/" with "\/"
-                if (!filter.isEmpty()) {
-                    QStringList filters = filter.split("\n", QString::SkipEmptyParts);
-                    QStringList modified;
-
-                    foreach (QString f, filters) {
-                        int sep = f.indexOf('|');
-
-                        if (-1 == sep) {
-                            modified.append(f);
-                        } else {
-                            QString ext = f.left(sep + 1);
-                            QString text = f.mid(sep + 1);
-                            text.replace("/", "\\/");
-                            modified.append(ext + text);
-                        }
-                    }
+    // Only remember the folder's mount point if the whole folder is there
+    if (mirrorsFolder(url, localUrl)) {
+        ResolvedDir resolved;
 
-                    filter = modified.join("\n");
-                }
+        resolved.dir = parentUrl(url);
+        resolved.path = parentUrl(localUrl).path();
+        resolved.age.start();
+        theirResolvedDirs.prepend(resolved);
 
-                initDialog(caption, new KDialogDFileDialog(itsAppName, (Operation)request, intialFolder,
-                           filter, customWidgets, overW ? true : false));
-                return;
-            }
+        if (theirResolvedDirs.count() > RESOLVED_DIRS_MAX) {
+            theirResolvedDirs.removeLast();
         }
     }
 
-    qCDebug(kdialogd) << "Comms error, closing connection..." << itsFd;
-    // If we get here something was wrong, close connection...
-    close();
+    startJobs();
 }
 
-void KDialogDClient::finished()
+// Pass on the paths that are resolved, and that all before them are - the last of them are left for
+// takeItems(), once all are resolved
+void KDialogDUrlResolver::passOn()
 {
-    if (-1 == itsFd) {
-        return;
+    while (itsDone < itsUrls.count() && !itsPaths.at(itsDone).isNull()) {
+        itsItems.append(itsPaths.at(itsDone++));
     }
 
-    //
-    // * finished is emitted when a dialog is ok'ed/cancel'ed/closed
-    // * if the user just closes the dialog - neither ok nor cancel are emitted
-    // * the dir select dialog doesnt seem to set the QDialog result parameter
-    //   when it is accepted - so for this reason if ok is clicked we store an
-    //   'accepted' value there, and check for that after the dialog is finished.
-    qCDebug(kdialogd) << "finished " << (void *)itsDlg << itsAccepted << (itsDlg ? QDialog::Accepted == itsDlg->result() : false);
-
-    if (itsDlg && !(itsAccepted || QDialog::Accepted == itsDlg->result())) {
-        cancel();
+    if (itsDone == itsUrls.count()) {
+        finish(true);
+    } else if (itsBatched && !itsItems.isEmpty() &&
+               (itsItems.count() >= RESOLVE_BATCH_SIZE || itsTimer.elapsed() >= RESOLVE_BATCH_MSECS)) {
+        emit resolved(itsItems);
+        itsItems.clear();
+        itsTimer.restart();
     }
 }
 
-void KDialogDClient::ok(const QStringList &items)
+void KDialogDUrlResolver::finish(bool ok)
 {
-    int                        num = items.count();
-    QStringList::ConstIterator it(items.begin()),
-                end(items.end());
-    bool                       error = !writeData((char *)&num, 4);
-
-    for (; !error && it != end; ++it) {
-        qCDebug(kdialogd) << "writeString " << *it;
-        error = !writeString(*it);
+    if (itsFinished) {
+        return;
     }
 
-    if (error) {
-        close();
-    } else {
-        itsAccepted = true;
+    itsFinished = true;
+    killJobs();
+
+    if (itsUsedKio) {
+        KDialogD::stats().resolved.add(itsStarted.elapsed());
     }
 
-    if (itsDlg) {
-        itsDlg->deleteLater();
+    if (tracing() && itsWindow) {
+        traceSpan("resolve", itsWindow->property(TRACE_ID_PROPERTY).toByteArray().constData(), itsTraceStart);
     }
 
-    itsDlg = NULL;
+    emit finished(ok);
 }
 
-void KDialogDClient::cancel()
+void KDialogDUrlResolver::killJobs()
 {
-    qCDebug(kdialogd);
+    // Killed quietly, so these do not report their results
+    foreach (KJob *job, itsJobs.keys()) {
+        job->kill();
+    }
 
-    if (itsDlg) {
-        qCDebug(kdialogd) << "send cancel";
+    itsJobs.clear();
+}
 
-        int rv = 0;
+// Abandon whatever 'dlg' is doing - kill the KIO job that it is waiting on, and reject any message box that it
+// has open, so that it returns from accept() as soon as possible. A busy dialog releases itself once it has.
+static void abortDialog(QDialog *dlg, const QPointer<KJob> &job, bool busy)
+{
+    if (job) {
+        job->kill();
+    }
 
-        if (!writeData((char *)&rv, 4)) {
-            qCDebug(kdialogd) << "failed to write data!";
-            close();
+    foreach (QDialog *child, dlg->findChildren<QDialog *>()) {
+        if (child->isVisible()) {
+            child->reject();
         }
+    }
 
-        if (itsDlg) {
-            itsDlg->deleteLater();
-        }
+    dlg->hide();
 
-        itsDlg = NULL;
+    if (!busy) {
+        KDialogD::pool()->release(dlg);
     }
 }
 
-bool KDialogDClient::readData(QByteArray &buffer, int size)
-{
-    qCDebug(kdialogd) << "readData" << itsFd;
-    buffer.resize(size);
-    return ::readBlock(itsFd, buffer.data(), size);
-}
+// Limits on what a client may send us. Requests only hold a few short strings, so anything larger is a bug, or
+// malicious, and is refused before we buffer it.
+#define MAX_APP_NAME_LEN    1024
+#define MAX_REQUEST_LEN     (256 * 1024)
+#define MAX_REQUEST_STR_LEN (64 * 1024)
 
-bool KDialogDClient::readString(QString &str)
-{
-    qCDebug(kdialogd) << "readString" << itsFd;
+// Most that a connection's buffers may hold - its unread requests, and the results that it has yet to read. Any
+// more, and the client is dropped.
+#define MAX_CLIENT_BUFFERS  (16 * 1024 * 1024)
+
+// Most paths that are put in one frame for a client that can not take them in shared memory - so that one frame
+// never takes the connection over its budget. Larger selections go in several frames, to clients that take
+// RESULT_PARTs, and are otherwise answered as if cancelled.
+#define MAX_RESULT_LEN      (MAX_CLIENT_BUFFERS / 2)
 
-    int size;
+// Most requests that a connection may have open at once - each is a dialog on the GUI thread. Any more are
+// answered at once, as if cancelled, without being passed on.
+#define MAX_CLIENT_REQUESTS 16
 
-    if (!readData((char *)&size, 4)) {
+static bool fieldString(const Field &f, QString &str, bool &tooLong)
+{
+    if (!fieldIsString(&f)) {
         return false;
     }
 
-    QByteArray buffer;
-    buffer.resize(size);
-
-    if (!readData(buffer.data(), size)) {
+    if (f.length > MAX_REQUEST_STR_LEN) {
+        tooLong = true;
         return false;
     }
 
-    str = QString::fromUtf8(buffer.data());
+    str = QString::fromUtf8(f.data, f.length);
     return true;
 }
 
-bool KDialogDClient::writeString(const QString &str)
+static void addStringField(Buffer *b, FieldTag tag, const QString &str)
 {
-    qCDebug(kdialogd) << "writeString" << itsFd;
-
     QByteArray utf8(str.toUtf8());
 
-    int size = utf8.length() + 1;
+    addStringField(b, tag, utf8.constData(), utf8.length());
+}
 
-    return writeData((char *)&size, 4) && writeData(utf8.data(), size);
+// Stats are reported as "name value", or "name{label="value"} value", lines - which Prometheus can also read
+static void addStat(QString &report, const QString &name, quint64 value)
+{
+    report += name + ' ' + QString::number(value) + '\n';
 }
 
-void KDialogDClient::initDialog(const QString &caption, QDialog *d)
+static QString statName(const QString &name, const char *label, const QString &value)
 {
-    qCDebug(kdialogd) << "initDialog" << itsFd;
+    QString escaped(value);
 
-    itsAccepted = false;
-    itsDlg = d;
+    escaped.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n");
+    return name + '{' + label + "=\"" + escaped + "\"}";
+}
 
-    if (!caption.isEmpty()) {
-        itsDlg->setWindowTitle(caption);
+// Decode the fields of a MSG_OPEN - the GUI thread fills in any that were left empty
+static bool decodeRequest(uint32_t id, const Buffer &payload, KDialogDRequest &req, bool &tooLong)
+{
+    FieldIter it;
+    Field     f;
+    int       rv = 0,
+              overW = 0;
+    uint32_t  op = OP_NULL,
+              xid = 0;
+    bool      ok = true;
+
+    initFieldIter(&it, payload.data, payload.len);
+
+    while (ok && (rv = nextField(&it, &f)) > 0) {
+        switch (f.tag) {
+        case FIELD_OPERATION:
+            ok = fieldU32(&f, &op);
+            break;
+
+        case FIELD_XID:
+            ok = fieldU32(&f, &xid);
+            break;
+
+        case FIELD_TITLE:
+            ok = fieldString(f, req.caption, tooLong);
+            break;
+
+        case FIELD_START_DIR:
+            ok = fieldString(f, req.startDir, tooLong);
+            break;
+
+        case FIELD_FILTER:
+            ok = fieldString(f, req.filter, tooLong);
+            break;
+
+        case FIELD_CUSTOM_WIDGETS:
+            ok = fieldString(f, req.customWidgets, tooLong);
+            break;
+
+        case FIELD_OVERWRITE:
+            ok = fieldBool(&f, &overW);
+            break;
+
+        case FIELD_TRACE_ID:
+            // Only used to label our own trace, so one that is too long is just ignored
+            if ((ok = fieldIsString(&f)) && f.length < TRACE_ID_LEN) {
+                req.traceId = QByteArray(f.data, f.length);
+            }
+
+            break;
+
+        default:
+            break;
+        }
     }
 
-    if (itsXid) {
-        itsDlg->installEventFilter(this);
+    req.id = id;
+    req.op = (Operation)op;
+    req.xid = xid;
+    req.overWrite = overW ? true : false;
+
+    return ok && 0 == rv && op >= OP_FILE_OPEN && op <= OP_FOLDER;
+}
+
+#define MAX_IO_EVENTS    32
+
+// epoll data for the listening socket, and the wake up eventfd - connections have ids from 1 up
+#define IO_ID_LISTEN     -1
+#define IO_ID_WAKE       -2
+
+KDialogDIo::KDialogDIo(int listenFd, QObject *parent)
+    : QThread(parent),
+      itsListenFd(listenFd),
+      itsEpollFd(epoll_create1(EPOLL_CLOEXEC)),
+      itsWakeFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+      itsSpareFd(open("/dev/null", O_RDONLY | O_CLOEXEC)),
+      itsNextId(0),
+      itsIdleTimeout(0),
+      itsNextIdleCheck(0),
+      itsConnectionCount(0),
+      itsStop(false)
+{
+    struct epoll_event ev;
+
+    qRegisterMetaType<KDialogDRequest>();
+    qRegisterMetaType<uint32_t>("uint32_t");
+    memset(&itsAcceptStats, 0, sizeof(itsAcceptStats));
+    memset(&itsRejectStats, 0, sizeof(itsRejectStats));
+    memset(&itsTrafficStats, 0, sizeof(itsTrafficStats));
+    itsClock.start();
+
+    if (itsEpollFd < 0 || itsWakeFd < 0) {
+        qCritical() << "Failed to create epoll fds: " << strerror(errno);
+        return;
     }
 
-    connect(itsDlg, SIGNAL(ok(const QStringList &)), this, SLOT(ok(const QStringList &)));
-    connect(itsDlg, SIGNAL(finished(int)), this, SLOT(finished()));
-    itsDlg->show();
+    // A client that goes away between poll and accept must not block us
+    fcntl(itsListenFd, F_SETFL, fcntl(itsListenFd, F_GETFL) | O_NONBLOCK);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)IO_ID_LISTEN;
+    epoll_ctl(itsEpollFd, EPOLL_CTL_ADD, itsListenFd, &ev);
+    ev.data.u64 = (uint64_t)IO_ID_WAKE;
+    epoll_ctl(itsEpollFd, EPOLL_CTL_ADD, itsWakeFd, &ev);
 }
 
-bool KDialogDClient::eventFilter(QObject *object, QEvent *event)
+KDialogDIo::~KDialogDIo()
 {
-    if (object == itsDlg && QEvent::ShowToParent == event->type()) {
-#ifdef USE_KWIN
-        KWindowSystem::setMainWindow(itsDlg->windowHandle(), itsXid);
-        KWindowSystem::setState(itsDlg->winId(), NET::Modal | NET::SkipTaskbar | NET::SkipPager);
+    stop();
+    wait();
 
-        itsDlg->activateWindow();
-        itsDlg->raise();
+    foreach (const Command &cmd, itsCommands) {
+        Buffer data = cmd.output.data;
 
-        QPixmap icon = KWindowSystem::icon(itsXid, 16, 16, true, KWindowSystem::NETWM | KWindowSystem::WMHints);
+        freeBuffer(&data);
 
-        if (!icon.isNull()) {
-            itsDlg->setWindowIcon(QIcon(icon));
+        if (-1 != cmd.output.passFd) {
+            ::close(cmd.output.passFd);
         }
+    }
 
-#else
-        XSetTransientForHint(QX11Info::display(), itsDlg->winId(), itsXid);
-#endif
-        itsDlg->removeEventFilter(this);
+    if (-1 != itsWakeFd) {
+        ::close(itsWakeFd);
     }
 
-    return false;
-}
+    if (-1 != itsSpareFd) {
+        ::close(itsSpareFd);
+    }
 
-static QUrl resolveStartDir(const QString &startDir)
-{
-    return QUrl(startDir.isEmpty() || "~" == startDir ? QDir::homePath() : startDir);
+    if (-1 != itsEpollFd) {
+        ::close(itsEpollFd);
+    }
 }
 
-KDialogDFileDialog::KDialogDFileDialog(QString &an, Operation op, const QString &startDir,
-                                       const QString &filter, const QString &customWidgets, bool confirmOw)
-    : QFileDialog(NULL),
-      itsConfirmOw(confirmOw),
-      itsDone(false),
-      itsAppName(an)
+bool KDialogDIo::send(int conn, Buffer *frame, int passFd, bool notify)
 {
-    setModal(false);
+    if (frame->error) {
+        freeBuffer(frame);
 
-    if (!confirmOw) {
-        setOption(QFileDialog::DontConfirmOverwrite);
+        if (-1 != passFd) {
+            ::close(passFd);
+        }
+
+        return false;
     }
 
-    setDirectoryUrl(resolveStartDir(startDir));
+    Command cmd;
 
-    // Need to convert the filter list from KDE to Qt format
-    const QStringList filterList = filter.split('\n');
-    QStringList qtFilters;
+    cmd.conn = conn;
+    cmd.close = false;
+    cmd.output.data = *frame;
+    cmd.output.sent = 0;
+    cmd.output.passFd = passFd;
+    cmd.output.notify = notify;
+    initBuffer(frame);
 
-    foreach (const QString &filt, filterList) {
-        int idx = filt.indexOf('|');
+    itsMutex.lock();
+    itsCommands.append(cmd);
+    itsMutex.unlock();
+    wake();
+    return true;
+}
+
+void KDialogDIo::closeConnection(int conn)
+{
+    Command cmd;
+
+    cmd.conn = conn;
+    cmd.close = true;
+    initBuffer(&cmd.output.data);
+    cmd.output.sent = 0;
+    cmd.output.passFd = -1;
+    cmd.output.notify = false;
+
+    itsMutex.lock();
+    itsCommands.append(cmd);
+    itsMutex.unlock();
+    wake();
+}
+
+void KDialogDIo::stop()
+{
+    itsMutex.lock();
+    itsStop = true;
+    itsMutex.unlock();
+    wake();
+}
+
+void KDialogDIo::wake()
+{
+    uint64_t one = 1;
+
+    if (write(itsWakeFd, &one, sizeof(one)) < 0 && EAGAIN != errno) {
+        qCWarning(kdialogd) << "Failed to wake I/O thread" << strerror(errno);
+    }
+}
+
+void KDialogDIo::run()
+{
+    struct epoll_event events[MAX_IO_EVENTS];
+    bool               stopped = itsEpollFd < 0 || itsWakeFd < 0;
+
+    while (!stopped) {
+        int timeout = -1;
+
+        if (itsIdleTimeout > 0 && !itsConnections.isEmpty()) {
+            timeout = qMax(itsNextIdleCheck - itsClock.elapsed(), (qint64)0);
+        }
+
+        int num = epoll_wait(itsEpollFd, events, MAX_IO_EVENTS, timeout);
+
+        if (num < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+
+            qCritical() << "epoll_wait(): " << strerror(errno);
+            break;
+        }
+
+        for (int i = 0; i < num; ++i) {
+            int id = (int)events[i].data.u64;
+
+            if (IO_ID_LISTEN == id) {
+                accept();
+            } else if (IO_ID_WAKE == id) {
+                uint64_t count;
+
+                if (read(itsWakeFd, &count, sizeof(count)) > 0) {
+                    runCommands();
+                }
+            } else {
+                // Connections may have been dropped by an earlier event, or command, in this batch
+                Connection *c = itsConnections.value(id);
+
+                if (c && (events[i].events & EPOLLOUT) && !flush(c)) {
+                    drop(c);
+                    c = NULL;
+                }
+
+                if (c && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                    readConnection(c);
+                }
+            }
+        }
+
+        if (itsIdleTimeout > 0 && itsClock.elapsed() >= itsNextIdleCheck) {
+            closeIdle();
+        }
+
+        itsMutex.lock();
+        stopped = itsStop;
+        itsMutex.unlock();
+    }
+
+    foreach (Connection *c, itsConnections) {
+        drop(c, false);
+    }
+
+    qCDebug(kdialogd) << "Accepted" << itsAcceptStats.accepted << "connections, rejected" << itsAcceptStats.rejected
+                      << "refused" << itsAcceptStats.refused << "largest burst" << itsAcceptStats.largestBurst
+                      << "full bursts" << itsAcceptStats.fullBursts;
+    qCDebug(kdialogd) << "Rejected" << itsRejectStats.oversized << "oversized" << itsRejectStats.malformed << "malformed"
+                      << itsRejectStats.unexpected << "unexpected frames," << itsRejectStats.busy
+                      << "requests from busy connections, and" << itsRejectStats.overBudget << "connections over budget";
+}
+
+// Accept everything that is pending - with level triggered epoll, accepting one per wakeup would cost an
+// epoll_wait() per connection when many apps connect at once.
+void KDialogDIo::accept()
+{
+    unsigned int burst = 0,
+                 refused = 0;
+
+    for (;;) {
+        int fd = ::accept4(itsListenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (EINTR == errno || ECONNABORTED == errno) {
+                continue;
+            } else if ((EMFILE == errno || ENFILE == errno) && -1 != itsSpareFd) {
+                // The connection would stay queued, and wake us for ever - so use our spare fd to take it off
+                // the queue, and close it. The client will fall back to the Gtk dialog.
+                ::close(itsSpareFd);
+                fd = ::accept4(itsListenFd, NULL, NULL, SOCK_CLOEXEC);
+
+                if (fd >= 0) {
+                    ::close(fd);
+                    refused++;
+                }
+
+                itsSpareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+                if (fd >= 0) {
+                    continue;
+                }
+            } else if (EAGAIN != errno && EWOULDBLOCK != errno) {
+                qCWarning(kdialogd) << "accept(): " << strerror(errno);
+            }
+
+            break;
+        }
+
+        burst++;
+
+        if (!addConnection(fd)) {
+            refused++;
+        }
+    }
+
+    itsAcceptStats.refused += refused;
+
+    if (burst > itsAcceptStats.largestBurst) {
+        itsAcceptStats.largestBurst = burst;
+    }
+
+    if (burst >= (unsigned int)listenBacklog()) {
+        itsAcceptStats.fullBursts++;
+        qCWarning(kdialogd) << "Accepted" << burst << "connections at once, filling the backlog of" << listenBacklog()
+                            << "- others may have had to wait, KGTK_LISTEN_BACKLOG can raise it";
+    }
+
+    if (refused) {
+        qCWarning(kdialogd) << "Refused" << refused << "connections, out of file descriptors";
+    }
+
+    qCDebug(kdialogd) << "Accepted" << burst << "connections";
+}
+
+// Returns false if the connection was refused
+bool KDialogDIo::addConnection(int fd)
+{
+    qCDebug(kdialogd) << "New connection" << fd;
+
+#ifdef KGTK_ABSTRACT_SOCKET
+
+    // The abstract socket has no permissions, so anyone may connect - only talk to ourselves
+    if (!peerIsUs(fd, NULL)) {
+        qCWarning(kdialogd) << "Rejecting connection from another user";
+        ::close(fd);
+        itsAcceptStats.rejected++;
+        return true;
+    }
+
+#endif
+
+    Connection         *c = new Connection;
+    struct epoll_event ev;
+
+    if (++itsNextId <= 0) {
+        itsNextId = 1;
+    }
+
+    c->id = itsNextId;
+    c->fd = fd;
+    c->state = STATE_APP_NAME;
+    c->caps = 0;
+    c->events = EPOLLIN;
+    c->announced = false;
+    c->pending = 0;
+    c->lastActive = itsClock.elapsed();
+    c->queued = 0;
+    initReadBuffer(&c->in, fd);
+    initBuffer(&c->payload);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = c->events;
+    ev.data.u64 = (uint64_t)c->id;
+
+    if (epoll_ctl(itsEpollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        qCWarning(kdialogd) << "epoll_ctl(): " << strerror(errno);
+        ::close(fd);
+        delete c;
+        return false;
+    }
+
+    itsConnections.insert(c->id, c);
+    itsAcceptStats.accepted++;
+
+    if (0 == itsConnectionCount.fetchAndAddOrdered(1)) {
+        emit connectionsChanged(true);
+    }
+
+    return true;
+}
+
+void KDialogDIo::runCommands()
+{
+    QList<Command> commands;
+
+    itsMutex.lock();
+    commands.swap(itsCommands);
+    itsMutex.unlock();
+
+    foreach (Command cmd, commands) {
+        Connection *c = itsConnections.value(cmd.conn);
+
+        if (c && !cmd.close && STATE_READY == c->state) {
+            FrameHeader header;
+
+            if (cmd.output.data.len >= FRAME_HEADER_LEN && parseFrameHeader(cmd.output.data.data, &header) &&
+                    MSG_RESULT == header.type && c->pending > 0) {
+                c->pending--;
+            }
+
+            c->lastActive = itsClock.elapsed();
+
+            if (!queue(c, cmd.output) || !flush(c)) {
+                drop(c);
+            }
+
+            continue;
+        }
+
+        // Closed, or already gone
+        freeBuffer(&cmd.output.data);
+
+        if (-1 != cmd.output.passFd) {
+            ::close(cmd.output.passFd);
+        }
+
+        if (c) {
+            drop(c);
+        }
+    }
+}
+
+void KDialogDIo::readConnection(Connection *c)
+{
+    ssize_t rv = fillReadBuffer(&c->in);
+
+    c->lastActive = itsClock.elapsed();
+
+    if (rv > 0) {
+        itsTrafficStats.bytesRead += rv;
+    }
+
+    if (0 == rv || (rv < 0 && EAGAIN != errno && EWOULDBLOCK != errno)) {
+        qCDebug(kdialogd) << "Connection closed" << c->id;
+        drop(c);
+    } else if (STATE_CLOSING == c->state) {
+        c->in.start = c->in.end;
+    } else if (!handleFrames(c)) {
+        qCDebug(kdialogd) << "Comms error, closing connection..." << c->id;
+        drop(c);
+    } else if (!flush(c)) {
+        drop(c);
+    } else {
+        // Requests are rare, so do not keep buffers around for them
+        releaseReadBuffer(&c->in);
+        freeBuffer(&c->payload);
+    }
+}
+
+// Handle everything that has been completely received. Returns false if the connection should be dropped.
+bool KDialogDIo::handleFrames(Connection *c)
+{
+    while (STATE_CLOSING != c->state) {
+        if (STATE_APP_NAME == c->state) {
+            uint32_t appNameLen;
+
+            if (bufferedBytes(&c->in) < sizeof(appNameLen)) {
+                return true;
+            }
+
+            appNameLen = getU32(&c->in.data[c->in.start]);
+
+            if (appNameLen > MAX_APP_NAME_LEN) {
+                qCWarning(kdialogd) << "Invalid application name length" << appNameLen;
+                itsRejectStats.oversized++;
+                return false;
+            }
+
+            if (bufferedBytes(&c->in) < sizeof(appNameLen) + appNameLen) {
+                return true;
+            }
+
+            c->in.start += sizeof(appNameLen);
+            // libkgtk sends the name's terminating NUL, which must not end up in its config group
+            c->appName = 0 == appNameLen ? QString("Generic")
+                                         : QString::fromUtf8(&c->in.data[c->in.start],
+                                                             (int)qstrnlen(&c->in.data[c->in.start], appNameLen));
+            c->in.start += appNameLen;
+            c->state = STATE_HELLO;
+            continue;
+        }
+
+        int available = frameBuffered(&c->in, MAX_REQUEST_LEN);
+
+        if (available < 0) {
+            FrameHeader header;
+
+            if (parseFrameHeader(&c->in.data[c->in.start], &header)) {
+                qCWarning(kdialogd) << "Client" << c->appName << "sent a frame of" << header.length << "bytes";
+                itsRejectStats.oversized++;
+            } else {
+                itsRejectStats.malformed++;
+            }
+
+            return false;
+        } else if (0 == available) {
+            return true;
+        }
+
+        if (STATE_HELLO == c->state) {
+            Output   welcome;
+            uint32_t version = 0,
+                     caps = 0;
+
+            initBuffer(&welcome.data);
+            welcome.sent = 0;
+            welcome.passFd = -1;
+            welcome.notify = false;
+
+            if (!readHandshake(&c->in, MSG_HELLO, &version, &caps)) {
+                qCWarning(kdialogd) << "Client" << c->appName << "failed handshake, protocol version" << version
+                                    << "we have" << KGTK_PROTOCOL_VERSION;
+
+                if (!version) {
+                    itsRejectStats.malformed++;
+                    return false;
+                }
+
+                // Let the client know what we speak, so that it can report the mismatch - and then close
+                addHandshake(&welcome.data, MSG_WELCOME, 0);
+                c->state = STATE_CLOSING;
+                return queue(c, welcome);
+            }
 
-        if (idx != -1) {
-            qtFilters.append(filt.mid(idx + 1) + " (" + filt.left(idx) + ')');
+            c->caps = caps & KGTK_CAPS;
+            addHandshake(&welcome.data, MSG_WELCOME, c->caps);
+            c->state = STATE_READY;
+
+            if (!queue(c, welcome)) {
+                return false;
+            }
         } else {
-            qtFilters.append(filt);
+            FrameHeader header;
+
+            if (!readFrame(&c->in, &header, &c->payload)) {
+                itsRejectStats.malformed++;
+                return false;
+            }
+
+            if (MSG_OPEN == header.type && 0 != header.id) {
+                KDialogDRequest req;
+                bool            tooLong = false;
+                quint64         start = traceNow();
+
+                if (!decodeRequest(header.id, c->payload, req, tooLong)) {
+                    if (tooLong) {
+                        qCWarning(kdialogd) << "Client" << c->appName << "sent an over long string";
+                        itsRejectStats.oversized++;
+                    } else {
+                        itsRejectStats.malformed++;
+                    }
+
+                    return false;
+                }
+
+                if (c->pending >= MAX_CLIENT_REQUESTS) {
+                    Output rejected;
+                    size_t frame;
+
+                    qCWarning(kdialogd) << "Client" << c->appName << "has too many requests open, refusing"
+                                        << header.id;
+                    itsRejectStats.busy++;
+                    initBuffer(&rejected.data);
+                    rejected.sent = 0;
+                    rejected.passFd = -1;
+                    rejected.notify = false;
+                    frame = beginFrame(&rejected.data, MSG_RESULT, header.id);
+                    addBoolField(&rejected.data, FIELD_ACCEPTED, 0);
+                    endFrame(&rejected.data, frame);
+
+                    if (!queue(c, rejected)) {
+                        return false;
+                    }
+
+                    continue;
+                }
+
+                c->announced = true;
+                c->pending++;
+                req.received.start();
+                req.traceReceived = start;
+                traceFlow("request", req.traceId.constData(), false, start);
+                traceSpan("decode", req.traceId.constData(), start);
+                emit request(c->id, c->appName, c->caps, req);
+            } else if (MSG_CANCEL == header.type && (c->caps & CAP_CANCEL)) {
+                if (c->announced) {
+                    emit cancelled(c->id, header.id);
+                }
+            } else if (MSG_STATS == header.type) {
+                emit statsRequested(c->id, header.id, statsReport());
+            } else {
+                itsRejectStats.unexpected++;
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Add to the connection's output. Returns false, having freed the output, if this would take the connection
+// over its budget - in which case it should be dropped.
+bool KDialogDIo::queue(Connection *c, const Output &output)
+{
+    if (c->in.size + c->queued + output.data.len > MAX_CLIENT_BUFFERS) {
+        Buffer data = output.data;
+
+        qCWarning(kdialogd) << "Client" << c->appName << "is not reading its results, dropping it with" << c->queued
+                            << "bytes queued";
+        itsRejectStats.overBudget++;
+        freeBuffer(&data);
+
+        if (-1 != output.passFd) {
+            ::close(output.passFd);
+        }
+
+        return false;
+    }
+
+    c->queued += output.data.len;
+    c->out.append(output);
+    return true;
+}
+
+// Write as much of the output as can be written without blocking. Returns false if the connection should be
+// dropped - on error, or once a closing connection has been flushed.
+bool KDialogDIo::flush(Connection *c)
+{
+    while (!c->out.isEmpty()) {
+        Output       &o = c->out.first();
+        struct iovec iov;
+
+        iov.iov_base = &o.data.data[o.sent];
+        iov.iov_len = o.data.len - o.sent;
+
+        ssize_t rv = sendSome(c->fd, &iov, 1, o.passFd, MSG_DONTWAIT);
+
+        if (rv < 0) {
+            if (EINTR == errno) {
+                continue;
+            } else if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                break;
+            }
+
+            qCDebug(kdialogd) << "Write failed" << c->id << strerror(errno);
+            return false;
+        }
+
+        // Any fd goes with the first byte
+        if (-1 != o.passFd) {
+            ::close(o.passFd);
+            o.passFd = -1;
+        }
+
+        o.sent += rv;
+        itsTrafficStats.bytesWritten += rv;
+
+        if (o.sent >= o.data.len) {
+            if (o.notify) {
+                emit written(c->id);
+            }
+
+            c->queued -= o.data.len;
+            freeBuffer(&o.data);
+            c->out.removeFirst();
+        }
+    }
+
+    if (STATE_CLOSING == c->state && c->out.isEmpty()) {
+        return false;
+    }
+
+    updateEvents(c);
+    return true;
+}
+
+void KDialogDIo::updateEvents(Connection *c)
+{
+    uint32_t events = (STATE_CLOSING == c->state ? 0 : EPOLLIN) | (c->out.isEmpty() ? 0 : EPOLLOUT);
+
+    if (events != c->events) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.u64 = (uint64_t)c->id;
+
+        if (0 == epoll_ctl(itsEpollFd, EPOLL_CTL_MOD, c->fd, &ev)) {
+            c->events = events;
+        }
+    }
+}
+
+void KDialogDIo::drop(Connection *c, bool notify)
+{
+    qCDebug(kdialogd) << "Drop connection" << c->id;
+
+    epoll_ctl(itsEpollFd, EPOLL_CTL_DEL, c->fd, NULL);
+    ::close(c->fd);
+
+    foreach (Output o, c->out) {
+        freeBuffer(&o.data);
+
+        if (-1 != o.passFd) {
+            ::close(o.passFd);
+        }
+    }
+
+    freeReadBuffer(&c->in);
+    freeBuffer(&c->payload);
+    itsConnections.remove(c->id);
+
+    if (1 == itsConnectionCount.fetchAndAddOrdered(-1) && notify) {
+        emit connectionsChanged(false);
+    }
+
+    // The GUI thread only knows of connections that have sent requests
+    if (notify && c->announced) {
+        emit disconnected(c->id);
+    }
+
+    delete c;
+}
+
+// Close connections that have had no dialogs open, and no traffic, for the idle timeout - so that apps which
+// stay open do not keep us running. Clients that support it are told, and will reconnect when next needed.
+// Those still handshaking are just dropped, and older clients are left alone, as they would see an error.
+void KDialogDIo::closeIdle()
+{
+    qint64 now = itsClock.elapsed();
+    int    closed = 0;
+
+    foreach (Connection *c, itsConnections) {
+        if (STATE_CLOSING == c->state || now - c->lastActive < itsIdleTimeout) {
+            continue;
+        }
+
+        if (STATE_READY != c->state) {
+            closed++;
+            drop(c);
+        } else if ((c->caps & CAP_GOODBYE) && 0 == c->pending && c->out.isEmpty() && 0 == bufferedBytes(&c->in)) {
+            Output goodbye;
+
+            initBuffer(&goodbye.data);
+            endFrame(&goodbye.data, beginFrame(&goodbye.data, MSG_GOODBYE, 0));
+            goodbye.sent = 0;
+            goodbye.passFd = -1;
+            goodbye.notify = false;
+            c->state = STATE_CLOSING;
+            closed++;
+
+            if (!queue(c, goodbye) || !flush(c)) {
+                drop(c);
+            }
+        }
+    }
+
+    if (closed) {
+        qCDebug(kdialogd) << "Closed" << closed << "idle connections";
+    }
+
+    // So connections are closed within a quarter of the timeout of going idle - closer is not worth the wakeups
+    itsNextIdleCheck = now + qMax(itsIdleTimeout / 4, 1000);
+}
+
+QString KDialogDIo::statsReport() const
+{
+    QMap<QString, int> apps;
+    QString            report;
+
+    foreach (const Connection *c, itsConnections) {
+        if (STATE_APP_NAME != c->state) {
+            apps[c->appName]++;
         }
     }
 
-    setNameFilters(qtFilters);
+    addStat(report, "kdialogd_connections", itsConnections.count());
+
+    QMap<QString, int>::ConstIterator it(apps.constBegin()),
+                                      end(apps.constEnd());
+
+    for (; it != end; ++it) {
+        addStat(report, statName("kdialogd_app_connections", "app", it.key()), it.value());
+    }
+
+    addStat(report, "kdialogd_connections_accepted_total", itsAcceptStats.accepted);
+    addStat(report, "kdialogd_connections_rejected_total", itsAcceptStats.rejected);
+    addStat(report, "kdialogd_connections_refused_total", itsAcceptStats.refused);
+    addStat(report, "kdialogd_frames_rejected_total{reason=\"oversized\"}", itsRejectStats.oversized);
+    addStat(report, "kdialogd_frames_rejected_total{reason=\"malformed\"}", itsRejectStats.malformed);
+    addStat(report, "kdialogd_frames_rejected_total{reason=\"unexpected\"}", itsRejectStats.unexpected);
+    addStat(report, "kdialogd_requests_refused_total", itsRejectStats.busy);
+    addStat(report, "kdialogd_clients_over_budget_total", itsRejectStats.overBudget);
+    addStat(report, "kdialogd_bytes_read_total", itsTrafficStats.bytesRead);
+    addStat(report, "kdialogd_bytes_written_total", itsTrafficStats.bytesWritten);
+    return report;
+}
+
+KDialogD::KDialogD(QObject *parent)
+    : QObject(parent),
+#ifdef KDIALOGD_APP
+      itsTimer(NULL),
+      itsTimeoutVal(DEFAULT_TIMEOUT),
+      itsIdleTarget(DEFAULT_IDLE_TARGET),
+#endif
+      itsAbstract(false),
+      itsFd(::createSocket(itsAbstract)),
+      itsIo(NULL)
+{
+    if (itsFd < 0) {
+        qCritical() << "KDialogD could not create socket";
+#ifdef KDIALOGD_APP
+        QCoreApplication::exit(1);
+#endif
+    } else {
+        traceInit("kdialogd5");
+
+        // Clients only need the pid file when using the filesystem socket
+        if (!itsAbstract) {
+            std::ofstream f(getPidFileName());
+
+            if (f) {
+                f << getpid();
+                f.close();
+            }
+        }
+
+        if (!theirConfig) {
+            theirConfig = new KConfig(CFG_FILE_NAME);    // , KConfig::OnlyLocal);
+            theirConfigWriter = new KDialogDConfigWriter(CFG_FILE_NAME, this);
+            theirConfigWriter->start(QThread::LowPriority);
+        }
+
+        KConfigGroup general(theirConfig, CFG_TIMEOUT_GROUP);
+
+        theirPool = new KDialogDPool(qMax(general.readEntry(CFG_POOL_KEY, DEFAULT_POOL), 0), this);
+        theirDirCache = new KDialogDDirCache(qMax(general.readEntry(CFG_DIR_CACHE_KEY, DEFAULT_DIR_CACHE), 0), this);
+        theirFilterCache = new KDialogDFilterCache;
+        itsIo = new KDialogDIo(itsFd, this);
+        itsIo->setIdleTimeout(qMax(general.readEntry(CFG_IDLE_KEY, DEFAULT_IDLE), 0));
+        connect(itsIo, SIGNAL(connectionsChanged(bool)), this, SLOT(connectionsChanged(bool)));
+        connect(itsIo, SIGNAL(request(int, const QString &, uint32_t, const KDialogDRequest &)),
+                this, SLOT(request(int, const QString &, uint32_t, const KDialogDRequest &)));
+        connect(itsIo, SIGNAL(cancelled(int, uint32_t)), this, SLOT(cancelled(int, uint32_t)));
+        connect(itsIo, SIGNAL(disconnected(int)), this, SLOT(disconnected(int)));
+        connect(itsIo, SIGNAL(written(int)), this, SLOT(written(int)));
+        connect(itsIo, SIGNAL(statsRequested(int, uint32_t, const QString &)),
+                this, SLOT(statsRequested(int, uint32_t, const QString &)));
+        itsUptime.start();
+        itsIo->start();
+
+#ifdef KDIALOGD_APP
+
+        if (theirConfig->hasGroup(CFG_TIMEOUT_GROUP)) {
+            itsTimeoutVal = KConfigGroup(theirConfig, CFG_TIMEOUT_GROUP).readEntry(CFG_TIMEOUT_KEY, DEFAULT_TIMEOUT);
+
+            if (itsTimeoutVal < 0) {
+                itsTimeoutVal = DEFAULT_TIMEOUT;
+            }
+
+            itsIdleTarget = qMax(general.readEntry(CFG_IDLE_TARGET_KEY, DEFAULT_IDLE_TARGET), 0);
+        }
+
+        qCDebug(kdialogd) << "Timeout:" << itsTimeoutVal << "idle memory target:" << itsIdleTarget;
+
+        if (itsTimeoutVal) {
+            connect(itsTimer = new QTimer(this), SIGNAL(timeout()), this, SLOT(timeout()));
+            itsTimer->setSingleShot(true);
+        }
+
+#endif
+    }
+}
+
+KDialogD::~KDialogD()
+{
+    // Clients send via the I/O thread, so must go first
+    qDeleteAll(itsClients);
+    itsClients.clear();
+    delete itsIo;
+    delete theirPool;
+    theirPool = NULL;
+    delete theirDirCache;
+    theirDirCache = NULL;
+    delete theirFilterCache;
+    theirFilterCache = NULL;
+
+    if (-1 != itsFd) {
+        close(itsFd);
+#ifdef KDIALOGD_APP
+
+        if (!itsAbstract) {
+            unlink(getSockName());
+        }
+
+#endif
+    }
+
+    delete theirConfigWriter;
+    theirConfigWriter = NULL;
+
+    if (theirConfig) {
+        delete theirConfig;
+    }
+
+    theirConfig = NULL;
+}
+
+void KDialogD::connectionsChanged(bool any)
+{
+    qCDebug(kdialogd) << "now have" << itsIo->connections() << "connections";
+#ifdef KDIALOGD_APP
+
+    if (any) {
+        if (itsTimer) {
+            itsTimer->stop();
+        }
+    } else {
+        qCDebug(kdialogd) << "no connections, starting timer";
+
+        if (itsTimeoutVal) {
+            itsTimer->start(itsTimeoutVal * 1000);    // Only single shot...
+        } else {
+            timeout();
+        }
+    }
+
+#endif
+}
+
+void KDialogD::request(int conn, const QString &appName, uint32_t caps, const KDialogDRequest &req)
+{
+    KDialogDClient *client = itsClients.value(conn);
+
+    if (!client) {
+        qCDebug(kdialogd) << "New client" << conn << appName;
+        client = new KDialogDClient(itsIo, conn, appName, caps, this);
+        itsClients.insert(conn, client);
+        connect(client, SIGNAL(error(KDialogDClient *)), this, SLOT(deleteClient(KDialogDClient *)));
+        connect(client, SIGNAL(idle(KDialogDClient *)), this, SLOT(deleteClient(KDialogDClient *)));
+    }
+
+    client->request(req);
+}
+
+void KDialogD::cancelled(int conn, uint32_t id)
+{
+    KDialogDClient *client = itsClients.value(conn);
+
+    // The dialog may already have been closed, and its result be on the way - so unknown ids are not an error
+    if (client) {
+        qCDebug(kdialogd) << "client cancelled" << id;
+        client->cancel(id);
+    }
+}
+
+void KDialogD::disconnected(int conn)
+{
+    KDialogDClient *client = itsClients.value(conn);
+
+    if (client) {
+        client->close();
+    }
+}
+
+void KDialogD::written(int conn)
+{
+    KDialogDClient *client = itsClients.value(conn);
+
+    if (client) {
+        client->written();
+    }
+}
+
+void KDialogD::deleteClient(KDialogDClient *client)
+{
+    qCDebug(kdialogd) << "Delete client";
+
+    int conn = itsClients.key(client);
+
+    if (conn) {
+        itsClients.remove(conn);
+        client->deleteLater();
+    }
+}
+
+void KDialogD::timeout()
+{
+#ifdef KDIALOGD_APP
+
+    if (0 == itsIo->connections()) {
+        // Staying resident, if we can be small enough, spares the next app waiting for kdialogd to start
+        if (itsIdleTarget > 0 && shrink()) {
+            qCDebug(kdialogd) << "Timeout and no connections, so shrank";
+            return;
+        }
+
+        // Keep the lock until we exit, so that no app connects to us in the meantime
+        if (grabLock(0) >= 0) { // 0=> no wait...
+            qCDebug(kdialogd) << "Timeout and no connections, so exit";
+            QCoreApplication::exit(0);
+        } else {
+            qCDebug(kdialogd) << "Timeout, but unable to grab lock file - app must be connecting";
+        }
+    }
+
+#endif
+}
+
+// Resident set size, and its peak, in bytes
+static void memoryUse(quint64 &rss, quint64 &peak)
+{
+    std::ifstream statm("/proc/self/statm");
+    quint64       size = 0,
+                  resident = 0;
+    struct rusage usage;
+
+    statm >> size >> resident;
+    rss = resident * sysconf(_SC_PAGESIZE);
+    peak = 0 == getrusage(RUSAGE_SELF, &usage) ? (quint64)usage.ru_maxrss * 1024 : 0;
+}
+
+#ifdef KDIALOGD_APP
+// Free all that we only keep to be quick - dialogs, listings, filters, and icons are built again as they are
+// next needed, which is still far quicker than starting a new kdialogd. Returns whether that got us down to
+// the idle memory target.
+bool KDialogD::shrink()
+{
+    quint64 before,
+            after,
+            peak;
+
+    memoryUse(before, peak);
+    theirPool->drain();
+    theirDirCache->clear();
+    theirFilterCache->clear();
+    KDialogDUrlResolver::clearResolvedDirs();
+    QPixmapCache::clear();
+#ifdef __GLIBC__
+    // Freed memory is otherwise mostly kept in malloc's arenas, and so still counts against us
+    malloc_trim(0);
+#endif
+    memoryUse(after, peak);
+    theirStats.shrinks++;
+
+    qCDebug(kdialogd) << "Shrank from" << before / 1024 << "KiB to" << after / 1024 << "KiB";
+    return after <= (quint64)itsIdleTarget * 1024 * 1024;
+}
+#endif
+
+void KDialogD::statsRequested(int conn, uint32_t id, const QString &ioStats)
+{
+    static const char *constOps[OP_FOLDER + 1] = { NULL, "open", "open_multiple", "save", "folder" };
+
+    QString report(ioStats);
+    quint64 rss,
+            peak;
+    Buffer  response;
+    size_t  frame;
+
+    memoryUse(rss, peak);
+    addStat(report, "kdialogd_uptime_seconds", itsUptime.elapsed() / 1000);
+    addStat(report, "kdialogd_rss_bytes", rss);
+    addStat(report, "kdialogd_rss_peak_bytes", peak);
+    addStat(report, "kdialogd_idle_shrinks_total", theirStats.shrinks);
+    addStat(report, "kdialogd_clients", itsClients.count());
+
+    for (int op = OP_FILE_OPEN; op <= OP_FOLDER; ++op) {
+        addStat(report, statName("kdialogd_requests_total", "op", constOps[op]), theirStats.requests[op]);
+    }
+
+    addStat(report, "kdialogd_requests_accepted_total", theirStats.accepted);
+    addStat(report, "kdialogd_requests_cancelled_total", theirStats.cancelled);
+    addStat(report, "kdialogd_paths_total", theirStats.paths);
+    report += theirStats.shown.report("kdialogd_show_ms");
+    report += theirStats.answered.report("kdialogd_answer_ms");
+    report += theirStats.resolved.report("kdialogd_kio_resolve_ms");
+
+    const char                 *cacheNames[] = { "pool", "dir_listing", "filters", "resolved_dirs" };
+    const KDialogDStats::Cache *caches[] = { &theirStats.pool, &theirStats.dirCache, &theirStats.filterCache,
+                                             &theirStats.resolvedDirs };
+
+    for (unsigned int c = 0; c < sizeof(caches) / sizeof(caches[0]); ++c) {
+        addStat(report, statName("kdialogd_cache_hits_total", "cache", cacheNames[c]), caches[c]->hits);
+        addStat(report, statName("kdialogd_cache_misses_total", "cache", cacheNames[c]), caches[c]->misses);
+    }
+
+    initBuffer(&response);
+    frame = beginFrame(&response, MSG_STATS_REPLY, id);
+    addStringField(&response, FIELD_STATS, report);
+    endFrame(&response, frame);
+    itsIo->send(conn, &response);
+}
+
+// The longest latency counted in each bucket but the last
+static const qint64 constHistogramBounds[] = { 10, 30, 100, 300, 1000, 3000, 10000, 30000, 100000 };
+
+KDialogDHistogram::KDialogDHistogram()
+    : itsCount(0),
+      itsSum(0)
+{
+    memset(itsCounts, 0, sizeof(itsCounts));
+}
+
+void KDialogDHistogram::add(qint64 ms)
+{
+    int bucket = 0;
+
+    while (bucket < BUCKETS - 1 && ms > constHistogramBounds[bucket]) {
+        bucket++;
+    }
+
+    itsCounts[bucket]++;
+    itsCount++;
+    itsSum += ms;
+}
+
+// As Prometheus has them - the count of each bucket includes those before it
+QString KDialogDHistogram::report(const QString &name) const
+{
+    QString report;
+    quint64 count = 0;
+
+    for (int bucket = 0; bucket < BUCKETS; ++bucket) {
+        count += itsCounts[bucket];
+        addStat(report, statName(name + "_bucket", "le", BUCKETS - 1 == bucket
+                                                         ? QString("+Inf")
+                                                         : QString::number(constHistogramBounds[bucket])), count);
+    }
+
+    addStat(report, name + "_sum", itsSum);
+    addStat(report, name + "_count", itsCount);
+    return report;
+}
+
+KDialogDStats::KDialogDStats()
+    : accepted(0),
+      cancelled(0),
+      paths(0),
+      shrinks(0)
+{
+    memset(requests, 0, sizeof(requests));
+    memset(&pool, 0, sizeof(pool));
+    memset(&dirCache, 0, sizeof(dirCache));
+    memset(&filterCache, 0, sizeof(filterCache));
+    memset(&resolvedDirs, 0, sizeof(resolvedDirs));
+}
+
+void KDialogD::writeConfigEntry(const QString &group, const char *key, const QVariant &value)
+{
+    if (theirConfig) {
+        // Not persistent, so that this copy never writes it - else it would when deleted, on the GUI thread
+        KConfigGroup(theirConfig, group).writeEntry(key, value, KConfigBase::WriteConfigFlags());
+        theirConfigWriter->writeEntry(group, key, value);
+    }
+}
+
+// Wait this long after the last change before writing, but never longer than the maximum after the first
+#define CONFIG_WRITE_DELAY     2000
+#define CONFIG_WRITE_MAX_DELAY 10000
+
+KDialogDConfigWriter::KDialogDConfigWriter(const QString &fileName, QObject *parent)
+    : QThread(parent),
+      itsFileName(fileName),
+      itsStop(false)
+{
+}
+
+KDialogDConfigWriter::~KDialogDConfigWriter()
+{
+    itsMutex.lock();
+    itsStop = true;
+    itsChanged.wakeOne();
+    itsMutex.unlock();
+    wait();
+}
+
+void KDialogDConfigWriter::writeEntry(const QString &group, const char *key, const QVariant &value)
+{
+    itsMutex.lock();
+    itsPending[group][key] = value;
+    itsChanged.wakeOne();
+    itsMutex.unlock();
+}
+
+void KDialogDConfigWriter::run()
+{
+    // Only ever used from this thread
+    KConfig config(itsFileName);
+
+    itsMutex.lock();
+
+    while (!itsStop || !itsPending.isEmpty()) {
+        if (itsPending.isEmpty()) {
+            itsChanged.wait(&itsMutex);
+            continue;
+        }
+
+        QElapsedTimer timer;
+
+        timer.start();
+
+        while (!itsStop && timer.elapsed() < CONFIG_WRITE_MAX_DELAY &&
+                itsChanged.wait(&itsMutex, qMin(CONFIG_WRITE_DELAY, (int)(CONFIG_WRITE_MAX_DELAY - timer.elapsed())))) {
+        }
+
+        QMap<QString, QMap<QByteArray, QVariant> > pending;
+
+        pending.swap(itsPending);
+        itsMutex.unlock();
+
+        QMap<QString, QMap<QByteArray, QVariant> >::ConstIterator group(pending.constBegin()),
+             end(pending.constEnd());
+
+        for (; group != end; ++group) {
+            KConfigGroup                              cfg(&config, group.key());
+            QMap<QByteArray, QVariant>::ConstIterator it(group.value().constBegin()),
+                 groupEnd(group.value().constEnd());
+
+            for (; it != groupEnd; ++it) {
+                cfg.writeEntry(it.key().constData(), it.value());
+            }
+        }
+
+        // Merges with whatever is on disk, so nothing else that was changed there is lost
+        if (!config.sync()) {
+            qCWarning(kdialogd) << "Failed to write" << itsFileName;
+        }
+
+        qCDebug(kdialogd) << "Wrote" << pending.count() << "config groups";
+        itsMutex.lock();
+    }
+
+    itsMutex.unlock();
+}
+
+KDialogDClient::KDialogDClient(KDialogDIo *io, int conn, const QString &an, uint32_t caps, QObject *parent)
+    : QObject(parent),
+      itsIo(io),
+      itsConn(conn),
+      itsCaps(caps),
+      itsWriting(false),
+      itsAppName(an)
+{
+    qCDebug(kdialogd) << "new client..." << itsAppName << " (" << itsConn << ")";
+}
+
+KDialogDClient::~KDialogDClient()
+{
+    qCDebug(kdialogd) << "Deleted client" << itsAppName;
+}
+
+void KDialogDClient::close()
+{
+    qCDebug(kdialogd) << "close" << itsConn;
+
+    // Take the requests first, so that closing the dialogs does not try to send cancels
+    QMap<uint32_t, Request> requests;
+
+    requests.swap(itsRequests);
+    itsReplies.clear();
+    itsFailed.clear();
+
+    foreach (const Request &req, requests) {
+        req.dlg->disconnect(this);
+        QMetaObject::invokeMethod(req.dlg, "abort");
+    }
+
+    if (itsConn != -1) {
+        itsIo->closeConnection(itsConn);
+        itsConn = -1;
+        emit error(this);
+    }
+}
+
+#ifdef HAVE_MEMFD_CREATE
+// Copy a (large) path table into a memfd, and seal this so that the client can map it knowing that it can
+// no longer change underneath it.
+static int createSharedTable(const char *data, size_t len)
+{
+    int fd = memfd_create("kdialogd-result", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (fd < 0) {
+        qCWarning(kdialogd) << "memfd_create failed" << strerror(errno);
+        return -1;
+    }
+
+    for (size_t written = 0; written < len;) {
+        ssize_t rv = ::write(fd, data + written, len - written);
+
+        if (rv < 0 && EINTR == errno) {
+            continue;
+        }
+
+        if (rv <= 0) {
+            ::close(fd);
+            return -1;
+        }
+
+        written += rv;
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        qCWarning(kdialogd) << "Failed to seal result table" << strerror(errno);
+        ::close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+#endif
+
+void KDialogDClient::request(const KDialogDRequest &req)
+{
+    quint64 start = traceNow();
+
+    qCDebug(kdialogd) << "request" << itsConn << req.id;
+    traceSpan("dispatch", req.traceId.constData(), req.traceReceived);
+
+    if (-1 == itsConn) {
+        return;
+    }
+
+    // Only clients that negotiated multiplexing may have more than one dialog open
+    if ((!itsRequests.isEmpty() && !(itsCaps & CAP_MULTIPLEX)) || itsRequests.contains(req.id)) {
+        qCDebug(kdialogd) << "Comms error, closing connection..." << itsConn;
+        close();
+        return;
+    }
+
+    KDialogD::stats().requests[req.op]++;
+
+    QString caption(req.caption);
+
+    KDialogD::dirCache()->use(resolveStartDir(req.startDir));
+
+    if ("." == caption || caption.isEmpty())
+        switch (req.op) {
+        case OP_FILE_OPEN:
+        case OP_FILE_OPEN_MULTIPLE:
+            caption = i18n("Open");
+            break;
+
+        case OP_FILE_SAVE:
+            caption = i18n("Save As");
+            break;
+
+        case OP_FOLDER:
+            caption = i18n("Select Folder");
+            break;
+
+        default:
+            break;
+        }
+
+    QDialog *d;
+
+    if (OP_FOLDER == req.op) {
+        KDialogDDirSelectDialog *dlg = KDialogD::pool()->dirSelectDialog();
+
+        dlg->setup(itsAppName, req.startDir, true);
+        d = dlg;
+    } else {
+        KDialogDFileDialog *dlg = KDialogD::pool()->fileDialog();
+
+        dlg->setup(itsAppName, req.op, req.startDir, KDialogD::filterCache()->get(itsAppName, req.filter),
+                   req.customWidgets, req.overWrite);
+        d = dlg;
+    }
+
+    traceSpan("setup", req.traceId.constData(), start);
+    initDialog(req, caption, d);
+}
+
+void KDialogDClient::finished()
+{
+    if (-1 == itsConn) {
+        return;
+    }
+
+    //
+    // * finished is emitted when a dialog is ok'ed/cancel'ed/closed
+    // * if the user just closes the dialog - neither ok nor cancel are emitted
+    // * the dir select dialog doesnt seem to set the QDialog result parameter
+    //   when it is accepted - but once ok has been handled the request is
+    //   removed, so anything still known here has not been accepted.
+    QDialog  *dlg = qobject_cast<QDialog *>(sender());
+    uint32_t id = requestId(dlg);
+
+    qCDebug(kdialogd) << "finished " << (void *)dlg << id << (dlg ? QDialog::Accepted == dlg->result() : false);
+
+    if (id && QDialog::Accepted != dlg->result()) {
+        cancel(id);
+    }
+}
+
+void KDialogDClient::resolved(const QStringList &items)
+{
+    uint32_t id = -1 == itsConn ? 0 : requestId(sender());
+
+    if (!id) {
+        return;
+    }
+
+    if (!(itsCaps & CAP_STREAM)) {
+        itsRequests[id].items += items;
+    } else if (!sendPart(id, items)) {
+        close();
+    }
+}
+
+void KDialogDClient::ok(const QStringList &items, const QString &selectedFilter, const QString &customWidgets)
+{
+    uint32_t id = requestId(sender());
+
+    if (!id) {
+        return;
+    }
+
+    Request req = itsRequests.take(id);
+
+    answered(req, true);
+    req.dlg->disconnect(this);
+    KDialogD::pool()->release(req.dlg);
+
+    // The app is likely to start its next dialog where this one left off
+    if (!items.isEmpty()) {
+        KDialogD::dirCache()->use(QUrl::fromLocalFile(QFileInfo(items.first()).absolutePath()));
+    }
+
+    if (!sendResult(id, req.traceId, true, req.items.isEmpty() ? items : req.items + items, selectedFilter,
+                    customWidgets)) {
+        close();
+    } else if (isIdle()) {
+        emit idle(this);
+    }
+}
+
+void KDialogDClient::cancel(uint32_t id)
+{
+    qCDebug(kdialogd) << id;
+
+    if (itsRequests.contains(id)) {
+        qCDebug(kdialogd) << "send cancel";
+
+        Request req = itsRequests.take(id);
+        QDialog *dlg = req.dlg;
+
+        answered(req, false);
+        dlg->disconnect(this);
+        QMetaObject::invokeMethod(dlg, "abort");
+
+        if (!sendResult(id, req.traceId, false)) {
+            qCDebug(kdialogd) << "failed to write data!";
+            close();
+        } else if (isIdle()) {
+            emit idle(this);
+        }
+    }
+}
+
+// The I/O thread has written the last frame that we gave it - so give it the next
+void KDialogDClient::written()
+{
+    itsWriting = false;
+
+    if (-1 == itsConn) {
+        return;
+    }
+
+    if (!sendReplies()) {
+        close();
+    } else if (isIdle()) {
+        emit idle(this);
+    }
+}
+
+// Nothing open, and nothing left to send
+bool KDialogDClient::isIdle() const
+{
+    return itsRequests.isEmpty() && itsReplies.isEmpty() && !itsWriting;
+}
+
+// Add the path fields for items[next...] to 'response', and move 'next' past those added. A client that can not
+// take its paths in shared memory gets no more than MAX_RESULT_LEN of them at once, and the rest must go in
+// further frames. For huge selections the paths are moved into a sealed memfd, which the client then maps
+// instead of having the whole list copied through the socket - in which case the memfd is returned, and must be
+// passed with the frame.
+int KDialogDClient::addPaths(Buffer *response, const QStringList &items, int &next) const
+{
+    size_t paths = response->len;
+    int    first = next;
+
+    for (; next < items.count(); ++next) {
+        size_t len = response->len;
+
+        qCDebug(kdialogd) << "item" << items[next];
+        addStringField(response, FIELD_PATH, items[next]);
+
+        // Leave this one for the next frame - unless it is the first, which has to go somewhere
+        if (!(itsCaps & CAP_SHM) && response->len > MAX_RESULT_LEN && next > first) {
+            response->len = len;
+            break;
+        }
+    }
+
+    KDialogD::stats().paths += next - first;
+
+#ifdef HAVE_MEMFD_CREATE
+    int sharedFd = -1;
+
+    if ((itsCaps & CAP_SHM) && !response->error && response->len - paths >= SHM_THRESHOLD &&
+            -1 != (sharedFd = createSharedTable(&response->data[paths], response->len - paths))) {
+        uint32_t tableLen = response->len - paths;
+
+        qCDebug(kdialogd) << "passing" << next - first << "items in shared memory" << tableLen;
+        response->len = paths;
+        addU32Field(response, FIELD_SHARED_PATHS, tableLen);
+    }
+
+    return sharedFd;
+#else
+    return -1;
+#endif
+}
+
+// The reply to request 'id' that is still to be sent - the paths of a request are added to this as they are
+// resolved, until its result is
+KDialogDClient::Reply &KDialogDClient::queuedReply(uint32_t id)
+{
+    if (itsReplies.isEmpty() || itsReplies.last().id != id || itsReplies.last().result) {
+        Reply reply;
+
+        reply.id = id;
+        reply.next = 0;
+        reply.result = false;
+        reply.accepted = false;
+        itsReplies.append(reply);
+    }
+
+    return itsReplies.last();
+}
+
+bool KDialogDClient::sendPart(uint32_t id, const QStringList &items)
+{
+    if (!items.isEmpty()) {
+        queuedReply(id).items += items;
+    }
+
+    return sendReplies();
+}
+
+bool KDialogDClient::sendResult(uint32_t id, const QByteArray &traceId, bool accepted, const QStringList &items,
+                                const QString &selectedFilter, const QString &customWidgets)
+{
+    Reply &reply = queuedReply(id);
+
+    reply.items += items;
+    reply.result = true;
+    reply.accepted = accepted;
+    reply.selectedFilter = selectedFilter;
+    reply.customWidgets = customWidgets;
+    reply.traceId = traceId;
+    return sendReplies();
+}
+
+// Send the replies that are waiting, a frame at a time. Each frame waits for the one before it to be written, so
+// that however large a selection is, the client's buffers only ever hold one frame of it. The paths that do not
+// fit in a result go ahead of it in RESULT_PARTs, if the client takes them - otherwise the request is answered as
+// if cancelled. Returns false if the connection should be closed.
+bool KDialogDClient::sendReplies()
+{
+    while (!itsWriting && !itsReplies.isEmpty()) {
+        Reply   &reply = itsReplies.first();
+        Buffer  paths,
+                response;
+        size_t  frame;
+        int     sharedFd;
+        bool    last;
+        quint64 start = traceNow();
+
+        // The client drops any paths that it has had, once it sees that the result was not accepted
+        if (itsFailed.contains(reply.id)) {
+            reply.items.clear();
+            reply.next = 0;
+            reply.accepted = false;
+
+            if (!reply.result) {
+                itsReplies.removeFirst();
+                continue;
+            }
+
+            itsFailed.remove(reply.id);
+        }
+
+        initBuffer(&paths);
+        initBuffer(&response);
+        sharedFd = addPaths(&paths, reply.items, reply.next);
+        last = reply.result && reply.next >= reply.items.count();
+
+        if (reply.next < reply.items.count() && !(itsCaps & CAP_STREAM)) {
+            qCWarning(kdialogd) << "Selection of" << reply.items.count() << "items is too large to send to"
+                                << itsAppName << "- answering it as cancelled";
+            freeBuffer(&paths);
+
+            if (-1 != sharedFd) {
+                ::close(sharedFd);
+            }
+
+            itsFailed.insert(reply.id);
+            continue;
+        }
+
+        frame = beginFrame(&response, last ? MSG_RESULT : MSG_RESULT_PART, reply.id);
+
+        if (last) {
+            addBoolField(&response, FIELD_ACCEPTED, reply.accepted);
+        }
+
+        if (paths.error) {
+            response.error = 1;
+        } else if (paths.len) {
+            appendBuffer(&response, paths.data, paths.len);
+        }
+
+        freeBuffer(&paths);
+
+        if (last && !reply.selectedFilter.isEmpty()) {
+            addStringField(&response, FIELD_SELECTED_FILTER, reply.selectedFilter);
+        }
+
+        if (last && !reply.customWidgets.isEmpty()) {
+            addStringField(&response, FIELD_CUSTOM_RESULT, reply.customWidgets);
+        }
+
+        endFrame(&response, frame);
+
+        if (response.error) {
+            qCWarning(kdialogd) << "Failed to build the reply to" << reply.id << "for" << itsAppName;
+            freeBuffer(&response);
+
+            if (-1 != sharedFd) {
+                ::close(sharedFd);
+            }
+
+            // Could not even say that it was not accepted
+            if (last && !reply.accepted) {
+                return false;
+            }
+
+            itsFailed.insert(reply.id);
+            continue;
+        }
+
+        QByteArray traceId = reply.traceId;
+
+        if (last) {
+            traceFlow("result", traceId.constData(), true, start);
+        }
+
+        if (last || (!reply.result && reply.next >= reply.items.count())) {
+            itsReplies.removeFirst();
+        }
+
+        // The I/O thread takes the response, and the shared fd
+        itsWriting = true;
+
+        if (!itsIo->send(itsConn, &response, sharedFd, true)) {
+            return false;
+        }
+
+        if (last) {
+            traceSpan("sendResult", traceId.constData(), start);
+        }
+    }
+
+    return true;
+}
+
+void KDialogDClient::initDialog(const KDialogDRequest &r, const QString &caption, QDialog *d)
+{
+    qCDebug(kdialogd) << "initDialog" << itsConn << r.id;
+
+    quint64 start = traceNow();
+    Request req;
+
+    req.dlg = d;
+    req.xid = r.xid;
+    req.received = r.received;
+    req.shown = 0;
+    req.traceId = r.traceId;
+    req.traceShown = 0;
+    itsRequests.insert(r.id, req);
+
+    // For the resolver's span - pooled dialogs must not keep the id of the last request that used them
+    if (tracing()) {
+        d->setProperty(TRACE_ID_PROPERTY, r.traceId);
+    }
+
+    if (!caption.isEmpty()) {
+        d->setWindowTitle(caption);
+    }
+
+    // Pooled dialogs may still have the icon, and be transient for the window, of the last app that used them
+    d->setWindowIcon(QIcon());
+
+    if (r.xid) {
+        d->installEventFilter(this);
+    } else if (d->testAttribute(Qt::WA_WState_Created)) {
+#ifdef USE_KWIN
+        d->windowHandle()->setTransientParent(nullptr);
+        KWindowSystem::clearState(d->winId(), NET::Modal | NET::SkipTaskbar | NET::SkipPager);
+#else
+        XDeleteProperty(QX11Info::display(), d->winId(), XA_WM_TRANSIENT_FOR);
+#endif
+    }
+
+    connect(d, SIGNAL(resolved(const QStringList &)), this, SLOT(resolved(const QStringList &)));
+    connect(d, SIGNAL(ok(const QStringList &, const QString &, const QString &)),
+            this, SLOT(ok(const QStringList &, const QString &, const QString &)));
+    connect(d, SIGNAL(finished(int)), this, SLOT(finished()));
+    d->show();
+
+    qint64 shown = r.received.elapsed();
+
+    itsRequests[r.id].shown = shown;
+    itsRequests[r.id].traceShown = traceNow();
+    KDialogD::stats().shown.add(shown);
+    traceSpan("show", r.traceId.constData(), start);
+}
+
+void KDialogDClient::answered(const Request &req, bool accepted)
+{
+    KDialogDStats &stats = KDialogD::stats();
+
+    stats.answered.add(req.received.elapsed() - req.shown);
+    traceSpan("user", req.traceId.constData(), req.traceShown);
+
+    if (accepted) {
+        stats.accepted++;
+    } else {
+        stats.cancelled++;
+    }
+}
+
+uint32_t KDialogDClient::requestId(const QObject *dlg) const
+{
+    QMap<uint32_t, Request>::ConstIterator it(itsRequests.constBegin()),
+             end(itsRequests.constEnd());
+
+    for (; it != end; ++it)
+        if (it.value().dlg == dlg) {
+            return it.key();
+        }
+
+    return 0;
+}
+
+bool KDialogDClient::eventFilter(QObject *object, QEvent *event)
+{
+    uint32_t id = QEvent::ShowToParent == event->type() ? requestId(object) : 0;
+
+    if (id) {
+        QDialog      *dlg = itsRequests[id].dlg;
+        unsigned int xid = itsRequests[id].xid;
+
+#ifdef USE_KWIN
+        KWindowSystem::setMainWindow(dlg->windowHandle(), xid);
+        KWindowSystem::setState(dlg->winId(), NET::Modal | NET::SkipTaskbar | NET::SkipPager);
+
+        dlg->activateWindow();
+        dlg->raise();
+
+        QPixmap icon = KWindowSystem::icon(xid, 16, 16, true, KWindowSystem::NETWM | KWindowSystem::WMHints);
+
+        if (!icon.isNull()) {
+            dlg->setWindowIcon(QIcon(icon));
+        }
+
+#else
+        XSetTransientForHint(QX11Info::display(), dlg->winId(), xid);
+#endif
+        dlg->removeEventFilter(this);
+    }
+
+    return false;
+}
+
+KDialogDFileDialog::KDialogDFileDialog()
+    : QFileDialog(NULL),
+      itsConfirmOw(false),
+      itsBusy(false),
+      itsAborted(false),
+      itsCustomWidget(0L)
+{
+    setModal(false);
+}
+
+// Everything that a previous request may have changed is set here
+void KDialogDFileDialog::setup(const QString &an, Operation op, const QString &startDir,
+                               const KDialogDFiltersPtr &filters, const QString &customWidgets, bool confirmOw)
+{
+    itsAppName = an;
+    itsFilters = filters;
+    itsConfirmOw = confirmOw;
+    itsBusy = itsAborted = false;
+    itsJob = nullptr;
+    itsCustom.clear();
+    delete itsCustomWidget;
+    itsCustomWidget = 0L;
+    setResult(0);
+    setOption(QFileDialog::DontConfirmOverwrite, !confirmOw);
+    setDirectoryUrl(resolveStartDir(startDir));
+    selectFile(QString());
+    setNameFilters(filters->nameFilters);
 
     switch (op) {
     case OP_FILE_OPEN:
@@ -667,14 +2489,18 @@ KDialogDFileDialog::KDialogDFileDialog(QString &an, Operation op, const QString
     if (KDialogD::config()) {
         KConfigGroup cfg(KDialogD::config(), groupName(itsAppName));
 
-        selectUrl(cfg.readEntry(CFG_KEY_URLS, QStringList()).value(0));
+        QString url = cfg.readEntry(CFG_KEY_URLS, QStringList()).value(0);
+
+        if (!url.isEmpty()) {
+            selectUrl(url);
+        }
+
         resize(cfg.readEntry(CFG_KEY_DIALOG_SIZE, QSize(600, 400)));
     }
 
     if (!customWidgets.isEmpty()) {
         qCWarning(kdialogd) << "Client" << itsAppName << "requests custom widgets, which are not currently supported";
 
-        QWidget *custom = 0L;
         QBoxLayout *layout = 0;
         QStringList widgets = customWidgets.split("@@", QString::SkipEmptyParts);
 
@@ -685,13 +2511,13 @@ KDialogDFileDialog::KDialogDFileDialog(QString &an, Operation op, const QString
                 QString name = parts[0];
                 name.replace("_", "&");
 
-                if (!custom) {
-                    custom = new QWidget();
-                    layout = new QBoxLayout(QBoxLayout::TopToBottom, custom);
+                if (!itsCustomWidget) {
+                    itsCustomWidget = new QWidget();
+                    layout = new QBoxLayout(QBoxLayout::TopToBottom, itsCustomWidget);
                     layout->setMargin(0);
                 }
 
-                QCheckBox *cb = new QCheckBox(name, custom);
+                QCheckBox *cb = new QCheckBox(name, itsCustomWidget);
                 cb->setChecked("true" == parts[1]);
                 layout->addWidget(cb);
                 itsCustom.insert(parts[0], cb);
@@ -699,8 +2525,8 @@ KDialogDFileDialog::KDialogDFileDialog(QString &an, Operation op, const QString
         }
 
         // TODO: support for custom widgets
-        //if(custom)
-        //    fileWidget()->setCustomWidget(QString(), custom);
+        //if(itsCustomWidget)
+        //    fileWidget()->setCustomWidget(QString(), itsCustomWidget);
     }
 }
 
@@ -710,98 +2536,133 @@ void KDialogDFileDialog::accept()
 
     QList<QUrl> urls(selectedUrls());
     qCDebug(kdialogd) << urls.count() << acceptMode() << urls;
-    bool        good = true;
 
     if (urls.count()) {
-        QStringList items = urls2Local(urls, this);
+        // Busy until resolveFinished() - which may be called before start() returns
+        itsBusy = true;
+        itsResolver = new KDialogDUrlResolver(urls, this, true, this);
+        connect(itsResolver, SIGNAL(resolved(const QStringList &)), this, SIGNAL(resolved(const QStringList &)));
+        connect(itsResolver, SIGNAL(finished(bool)), this, SLOT(resolveFinished(bool)));
+        itsResolver->start();
+    }
+}
+
+void KDialogDFileDialog::resolveFinished(bool good)
+{
+    QList<QUrl> urls(selectedUrls());
+    QStringList items(itsResolver->takeItems());
+
+    itsResolver->deleteLater();
+    itsResolver = nullptr;
 
-        if (urls.count() != items.count()) {
+    if (!good) {
+        if (!itsAborted) {
             KMessageBox::sorry(this, i18n("You can only select local files."),
                                i18n("Remote Files Not Accepted"));
-            good = false;
-        } else if (itsConfirmOw && QFileDialog::AcceptSave == acceptMode()) {
+        }
+    } else if (itsConfirmOw && QFileDialog::AcceptSave == acceptMode()) {
+        bool exists;
+
+        if (urls.first().isLocalFile()) {
+            exists = localFileExists(urls.first().toLocalFile());
+        } else {
             KIO::StatJob *job = KIO::statDetails(urls.first(), KIO::StatJob::DestinationSide, KIO::StatNoDetails);
             KJobWidgets::setWindow(job, this);
+            itsJob = job;
+            exists = job->exec();
+        }
 
-            if (job->exec()) {			// destination exists
-                int result = KMessageBox::warningContinueCancel(this,
-                             i18n("File %1 exits.\nDo you want to replace it?")
-                             .arg(urls.first().toDisplayString()),
-                             i18n("File Exists"),
-                             KGuiItem(i18n("Replace"), "filesaveas"), KStandardGuiItem::cancel(), QString(),
-                             KMessageBox::Notify | KMessageBox::PlainCaption);
+        if (exists && !itsAborted) {	// destination exists
+            int result = KMessageBox::warningContinueCancel(this,
+                         i18n("File %1 exits.\nDo you want to replace it?")
+                         .arg(urls.first().toDisplayString()),
+                         i18n("File Exists"),
+                         KGuiItem(i18n("Replace"), "filesaveas"), KStandardGuiItem::cancel(), QString(),
+                         KMessageBox::Notify | KMessageBox::PlainCaption);
 
-                good = (result == KMessageBox::Continue);
-            }
+            good = (result == KMessageBox::Continue);
         }
+    }
 
-        if (good) {
-            QString filter = selectedNameFilter();
+    if (good && !itsAborted) {
+        // Back to the line that the client sent
+        QString filter = selectedNameFilter(),
+                custom;
 
-            if (!filter.isEmpty()) {
-                // Convert the Qt format filter back to KDE format
-                int idx = filter.lastIndexOf(" (");
+        filter = itsFilters->kdeFilters.value(filter, filter);
 
-                if (idx != -1) {
-                    if (filter.endsWith(')')) {
-                        filter.chop(1);
-                    }
+        if (itsCustom.count()) {
+            QMap<QString, QWidget *>::ConstIterator it(itsCustom.constBegin()),
+                 end(itsCustom.constEnd());
 
-                    filter = filter.mid(idx + 2) + '|' + filter.left(idx);
+            for (; it != end; ++it)
+                if (qobject_cast<const QCheckBox *>(it.value())) {
+                    custom = custom + "@@" + it.key() + "||" + QString(static_cast<const QCheckBox *>(it.value())->isChecked() ? "true" : "false");
                 }
+        }
 
-                items.append(filter);
-            }
+        emit ok(items, filter, custom);
+        hide();
+    } else {
+        setResult(QDialog::Rejected);
+    }
 
-            if (itsCustom.count()) {
-                QString custom;
-                QMap<QString, QWidget *>::ConstIterator it(itsCustom.constBegin()),
-                     end(itsCustom.constEnd());
+    itsBusy = false;
 
-                for (; it != end; ++it)
-                    if (qobject_cast<const QCheckBox *>(it.value())) {
-                        custom = custom + "@@" + it.key() + "||" + QString(static_cast<const QCheckBox *>(it.value())->isChecked() ? "true" : "false");
-                    }
+    if (itsAborted) {
+        KDialogD::pool()->release(this);
+    }
+}
 
-                if (!custom.isEmpty()) {
-                    items.append(custom);
-                }
-            }
+void KDialogDFileDialog::abort()
+{
+    itsAborted = true;
+    abortDialog(this, itsJob, itsBusy);
 
-            emit ok(items);
-            hide();
-        } else {
-            setResult(QDialog::Rejected);
-        }
+    // Whilst resolving we are busy, so this is what releases us
+    if (itsResolver) {
+        itsResolver->kill();
     }
 }
 
 KDialogDFileDialog::~KDialogDFileDialog()
 {
     qCDebug(kdialogd);
+    delete itsCustomWidget;
+}
 
-    if (KDialogD::config()) {
-        KConfigGroup cfg(KDialogD::config(), groupName(itsAppName));
+void KDialogDFileDialog::saveConfig()
+{
+    if (!itsAppName.isEmpty()) {
+        QStringList urls;
+
+        foreach (const QUrl &url, selectedUrls()) {
+            urls.append(url.toString());
+        }
 
-        cfg.writeEntry(CFG_KEY_URLS, selectedUrls());
-        cfg.writeEntry(CFG_KEY_DIALOG_SIZE, size());
+        KDialogD::writeConfigEntry(groupName(itsAppName), CFG_KEY_URLS, urls);
+        KDialogD::writeConfigEntry(groupName(itsAppName), CFG_KEY_DIALOG_SIZE, size());
     }
 }
 
-KDialogDDirSelectDialog::KDialogDDirSelectDialog(QString &an, const QString &startDir, bool localOnly,
-        QWidget *parent)
-    : QFileDialog(parent),
-      itsAppName(an)
+KDialogDDirSelectDialog::KDialogDDirSelectDialog()
+    : QFileDialog(NULL),
+      itsBusy(false),
+      itsAborted(false)
 {
     setModal(false);
     setAcceptMode(QFileDialog::AcceptOpen);
     setFileMode(QFileDialog::Directory);
     setOption(QFileDialog::ShowDirsOnly);
-    setDirectoryUrl(resolveStartDir(startDir));
+}
 
-    if (localOnly) {
-        setSupportedSchemes(QStringList() << "file");
-    }
+void KDialogDDirSelectDialog::setup(const QString &an, const QString &startDir, bool localOnly)
+{
+    itsAppName = an;
+    itsBusy = itsAborted = false;
+    setResult(0);
+    setDirectoryUrl(resolveStartDir(startDir));
+    setSupportedSchemes(localOnly ? QStringList() << "file" : QStringList());
 
     if (KDialogD::config()) {
         KConfigGroup cfg(KDialogD::config(), groupName(itsAppName, false));
@@ -814,32 +2675,522 @@ KDialogDDirSelectDialog::KDialogDDirSelectDialog(QString &an, const QString &sta
 KDialogDDirSelectDialog::~KDialogDDirSelectDialog()
 {
     qCDebug(kdialogd);
+}
 
-    if (KDialogD::config()) {
-        KConfigGroup cfg(KDialogD::config(), groupName(itsAppName, false));
-
+void KDialogDDirSelectDialog::saveConfig()
+{
+    if (!itsAppName.isEmpty()) {
         //TODO !!! writeConfig(KDialogD::config(), grp);
-        cfg.writeEntry(CFG_KEY_DIALOG_SIZE, size());
+        KDialogD::writeConfigEntry(groupName(itsAppName, false), CFG_KEY_DIALOG_SIZE, size());
     }
 }
 
 void KDialogDDirSelectDialog::slotOk()
 {
-    QList<QUrl> urls = selectedUrls();
-    QStringList items = urls2Local(urls, this);
+    // Busy until resolveFinished() - which may be called before start() returns
+    itsBusy = true;
+    itsResolver = new KDialogDUrlResolver(selectedUrls(), this, false, this);
+    connect(itsResolver, SIGNAL(finished(bool)), this, SLOT(resolveFinished(bool)));
+    itsResolver->start();
+}
+
+void KDialogDDirSelectDialog::resolveFinished(bool good)
+{
+    QStringList items(itsResolver->takeItems());
+
+    itsResolver->deleteLater();
+    itsResolver = nullptr;
 
-    if (urls.count() != items.count())
-        KMessageBox::sorry(this, i18n("You can only select local folders."),
-                           i18n("Remote Folders Not Accepted"));
-    else {
-        emit ok(items);
+    if (!good) {
+        if (!itsAborted)
+            KMessageBox::sorry(this, i18n("You can only select local folders."),
+                               i18n("Remote Folders Not Accepted"));
+    } else {
+        emit ok(items, QString(), QString());
         hide();
     }
+
+    itsBusy = false;
+
+    if (itsAborted) {
+        KDialogD::pool()->release(this);
+    }
+}
+
+void KDialogDDirSelectDialog::abort()
+{
+    itsAborted = true;
+    abortDialog(this, nullptr, itsBusy);
+
+    // Whilst resolving we are busy, so this is what releases us
+    if (itsResolver) {
+        itsResolver->kill();
+    }
+}
+
+KDialogDPool::KDialogDPool(int size, QObject *parent)
+    : QObject(parent),
+      itsSize(size),
+      itsInUse(0),
+      itsFillTimer(new QTimer(this))
+{
+    itsFillTimer->setSingleShot(true);
+    connect(itsFillTimer, SIGNAL(timeout()), this, SLOT(fill()));
+
+    // Build the first dialogs as soon as we are idle - when started on demand, the request that started us is
+    // usually not far behind, and can then take one of these
+    if (itsSize > 0) {
+        itsFillTimer->start(0);
+    }
+}
+
+KDialogDPool::~KDialogDPool()
+{
+    qDeleteAll(itsFileDialogs);
+    qDeleteAll(itsDirSelectDialogs);
+
+    foreach (const QPointer<QDialog> &dlg, itsReleased) {
+        delete dlg.data();
+    }
+}
+
+KDialogDFileDialog *KDialogDPool::fileDialog()
+{
+    itsInUse++;
+    itsFillTimer->stop();
+
+    if (itsFileDialogs.isEmpty()) {
+        KDialogD::stats().pool.misses++;
+        return new KDialogDFileDialog();
+    }
+
+    KDialogD::stats().pool.hits++;
+    return itsFileDialogs.takeLast();
+}
+
+KDialogDDirSelectDialog *KDialogDPool::dirSelectDialog()
+{
+    itsInUse++;
+    itsFillTimer->stop();
+
+    if (itsDirSelectDialogs.isEmpty()) {
+        KDialogD::stats().pool.misses++;
+        return new KDialogDDirSelectDialog();
+    }
+
+    KDialogD::stats().pool.hits++;
+    return itsDirSelectDialogs.takeLast();
+}
+
+void KDialogDPool::release(QDialog *dlg)
+{
+    if (itsReleased.contains(dlg)) {
+        return;
+    }
+
+    dlg->hide();
+    itsReleased.append(dlg);
+
+    // The dialog may still be unwinding from the signal that released it
+    QTimer::singleShot(0, this, SLOT(recycle()));
+}
+
+void KDialogDPool::drain()
+{
+    qCDebug(kdialogd) << "Deleting" << itsFileDialogs.count() + itsDirSelectDialogs.count() << "pooled dialogs";
+    itsFillTimer->stop();
+    qDeleteAll(itsFileDialogs);
+    itsFileDialogs.clear();
+    qDeleteAll(itsDirSelectDialogs);
+    itsDirSelectDialogs.clear();
+}
+
+void KDialogDPool::recycle()
+{
+    QList<QPointer<QDialog> > released;
+
+    released.swap(itsReleased);
+
+    foreach (const QPointer<QDialog> &dlg, released) {
+        itsInUse--;
+
+        if (!dlg) {
+            continue;
+        }
+
+        KDialogDFileDialog      *fileDlg = qobject_cast<KDialogDFileDialog *>(dlg.data());
+        KDialogDDirSelectDialog *dirDlg = fileDlg ? 0L : qobject_cast<KDialogDDirSelectDialog *>(dlg.data());
+
+        if (fileDlg) {
+            fileDlg->saveConfig();
+
+            if (itsFileDialogs.count() < itsSize) {
+                itsFileDialogs.append(fileDlg);
+                continue;
+            }
+        } else if (dirDlg) {
+            dirDlg->saveConfig();
+
+            if (itsDirSelectDialogs.count() < itsSize) {
+                itsDirSelectDialogs.append(dirDlg);
+                continue;
+            }
+        }
+
+        delete dlg.data();
+    }
+
+    scheduleFill();
+}
+
+// Build one missing dialog at a time, so that requests are not kept waiting behind the whole pool
+void KDialogDPool::fill()
+{
+    if (itsInUse) {
+        return;
+    }
+
+    if (itsFileDialogs.count() < itsSize) {
+        qCDebug(kdialogd) << "Building pooled file dialog";
+        itsFileDialogs.append(new KDialogDFileDialog());
+    } else if (itsDirSelectDialogs.count() < itsSize) {
+        qCDebug(kdialogd) << "Building pooled folder dialog";
+        itsDirSelectDialogs.append(new KDialogDDirSelectDialog());
+    }
+
+    scheduleFill();
+}
+
+void KDialogDPool::scheduleFill()
+{
+    if (!itsInUse && (itsFileDialogs.count() < itsSize || itsDirSelectDialogs.count() < itsSize)) {
+        itsFillTimer->start(0);
+    }
+}
+
+KDialogDDirCache::KDialogDDirCache(int maxItems, QObject *parent)
+    : QObject(parent),
+      itsMaxItems(maxItems)
+{
+}
+
+KDialogDDirCache::~KDialogDDirCache()
+{
+    qDeleteAll(itsListers);
+}
+
+void KDialogDDirCache::use(const QUrl &dir)
+{
+    // Start folders are usually plain paths
+    QUrl url(dir.scheme().isEmpty() ? QUrl::fromLocalFile(dir.path()) : dir);
+
+    // Remote folders are not kept, as that would keep their connections open
+    if (itsMaxItems <= 0 || !url.isLocalFile()) {
+        return;
+    }
+
+    url = url.adjusted(QUrl::StripTrailingSlash | QUrl::NormalizePathSegments);
+
+    for (int i = 0; i < itsListers.count(); ++i) {
+        if (itsListers.at(i)->url() == url) {
+            KDialogD::stats().dirCache.hits++;
+            itsListers.move(i, 0);
+            return;
+        }
+    }
+
+    KDialogD::stats().dirCache.misses++;
+
+    KCoreDirLister *lister = new KCoreDirLister(this);
+
+    qCDebug(kdialogd) << "Caching listing of" << url;
+    lister->setDelayedMimeTypes(true);
+    connect(lister, SIGNAL(completed()), this, SLOT(trim()));
+    itsListers.prepend(lister);
+    lister->openUrl(url);
+    trim();
+}
+
+// Drop the least recently used folders that take us over the limits - the most recent is always kept
+void KDialogDDirCache::trim()
+{
+    int items = 0;
+
+    for (int i = 0; i < itsListers.count(); ++i) {
+        items += itsListers.at(i)->items().count();
+
+        if (i && (items > itsMaxItems || i >= MAX_CACHED_DIRS)) {
+            while (itsListers.count() > i) {
+                KCoreDirLister *lister = itsListers.takeLast();
+
+                qCDebug(kdialogd) << "Dropping cached listing of" << lister->url();
+                // May be the lister whose completed() signal we are handling
+                lister->deleteLater();
+            }
+
+            break;
+        }
+    }
+}
+
+void KDialogDDirCache::clear()
+{
+    qCDebug(kdialogd) << "Dropping" << itsListers.count() << "cached listings";
+    qDeleteAll(itsListers);
+    itsListers.clear();
+}
+
+KDialogDFiltersPtr KDialogDFilterCache::get(const QString &appName, const QString &raw)
+{
+    uint hash = qHash(raw);
+
+    for (int i = 0; i < itsEntries.count(); ++i) {
+        const Entry &entry = itsEntries.at(i);
+
+        if (entry.hash == hash && entry.appName == appName && entry.filters->raw == raw) {
+            KDialogD::stats().filterCache.hits++;
+            itsEntries.move(i, 0);
+            return itsEntries.first().filters;
+        }
+    }
+
+    KDialogD::stats().filterCache.misses++;
+
+    Entry entry;
+
+    entry.appName = appName;
+    entry.hash = hash;
+    entry.filters = translate(raw);
+    itsEntries.prepend(entry);
+
+    if (itsEntries.count() > MAX_CACHED_FILTERS) {
+        itsEntries.removeLast();
+    }
+
+    return entry.filters;
+}
+
+void KDialogDFilterCache::clear()
+{
+    itsEntries.clear();
+}
+
+KDialogDFiltersPtr KDialogDFilterCache::translate(const QString &raw)
+{
+    KDialogDFilters *filters = new KDialogDFilters;
+
+    filters->raw = raw;
+
+    foreach (const QString &line, raw.split('\n', QString::SkipEmptyParts)) {
+        int     sep = line.indexOf('|');
+        QString nameFilter;
+
+        if (-1 == sep) {
+            nameFilter = line;
+        } else {
+            // LibreOffice has some "/" chars in its filternames - this seems to mess KFileDialog up, and we
+            // get blank names! So, foreach filtername we need to replace "/" with "\/"
+            QString name = line.mid(sep + 1);
+
+            name.replace("/", "\\/");
+            nameFilter = name + " (" + line.left(sep) + ')';
+        }
+
+        filters->nameFilters.append(nameFilter);
+        // QFileDialog simplifies the filters that it is given, and reports the selected one like that
+        filters->kdeFilters.insert(nameFilter.simplified(), line);
+    }
+
+    qCDebug(kdialogd) << "Translated" << filters->nameFilters.count() << "filters";
+    return KDialogDFiltersPtr(filters);
 }
 
 #ifdef KDIALOGD_APP
+// Launcher mode - bind the socket, and then start the daemon with it. Clients may connect, and queue their
+// requests, as soon as this returns - without waiting for Qt, or KDE, to initialise. The kernel holds what they
+// send until the daemon's I/O thread starts, and libkgtk sends its request straight after its HELLO - it only
+// waits for our WELCOME when it reads the reply.
+//
+// If 'readyFd' is set, a byte is written to it as soon as the socket is listening (or if kdialogd is found to
+// be running already) - so that whoever started us need not poll for the socket.
+static int launch(int readyFd)
+{
+    bool abstract = false;
+    int  fd;
+
+    if (-1 != readyFd) {
+        fcntl(readyFd, F_SETFD, FD_CLOEXEC);
+    }
+
+    fd = createSocket(abstract);
+
+    if (fd < 0 && -2 != fd) {
+        return 1;
+    }
+
+    if (-1 != readyFd) {
+        // Once the socket is listening, clients can connect - even though the daemon is not yet running
+        while (::write(readyFd, "R", 1) < 0 && EINTR == errno);
+        ::close(readyFd);
+    }
+
+    if (-2 == fd) {
+        return 0;    // Already running
+    }
+
+    switch (fork()) {
+    case -1:
+        qCritical() << "fork(): " << strerror(errno);
+        return 1;
+
+    case 0: {
+        char pid[16];
+
+        setsid();
+
+        if (LISTEN_FDS_START != fd) {
+            dup2(fd, LISTEN_FDS_START);
+            ::close(fd);
+        }
+
+        fcntl(LISTEN_FDS_START, F_SETFD, 0);
+        snprintf(pid, sizeof(pid), "%d", getpid());
+        setenv("LISTEN_PID", pid, 1);
+        setenv("LISTEN_FDS", "1", 1);
+        execl(KDIALOGD_LOCATION"/kdialogd5", "kdialogd5", (char *)NULL);
+        qCritical() << "exec(): " << strerror(errno);
+        _exit(1);
+    }
+
+    default:
+        return 0;
+    }
+}
+
+#define STATS_TIMEOUT 5000
+
+// Connect to the running daemon, without starting one. Returns the fd, or -1.
+static int connectToDaemon()
+{
+    const char *sock = getSockName();
+    int        fd = -1;
+
+#ifdef KGTK_ABSTRACT_SOCKET
+    struct sockaddr_un addr;
+    socklen_t          len = getAbstractSockAddr(&addr);
+
+    if ((fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0 &&
+            (::connect(fd, (struct sockaddr *)&addr, len) < 0 || !peerIsUs(fd, NULL))) {
+        ::close(fd);
+        fd = -1;
+    }
+
+#endif
+
+    if (-1 == fd && sock && (fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0) {
+        struct sockaddr_un addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, sock, sizeof(addr.sun_path) - 1);
+
+        if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    return fd;
+}
+
+// Stats mode - ask the running daemon what it has done, and print its reply
+static int printStats()
+{
+    static const char constAppName[] = "kdialogd5 --stats";
+
+    int         fd = connectToDaemon(),
+                rv = 1;
+    char        nameLen[4];
+    Buffer      request,
+                payload;
+    ReadBuffer  in;
+    FrameHeader header;
+    uint32_t    version = 0,
+                caps = 0;
+
+    if (-1 == fd) {
+        fprintf(stderr, "kdialogd5 is not running\n");
+        return 1;
+    }
+
+    // Sent all at once - the daemon reads the request once the handshake is done
+    initBuffer(&request);
+    initBuffer(&payload);
+    initReadBuffer(&in, fd);
+    in.timeout = STATS_TIMEOUT;
+    endFrame(&request, beginFrame(&request, MSG_STATS, 1));
+    putU32(nameLen, sizeof(constAppName));      // With the NUL, as libkgtk sends it
+
+    if (!writeBlock(fd, nameLen, sizeof(nameLen)) || !writeBlock(fd, constAppName, sizeof(constAppName)) ||
+            !writeHandshake(fd, MSG_HELLO, 0) || !writeBuffer(fd, &request)) {
+        fprintf(stderr, "Failed to send the request to kdialogd5\n");
+    } else if (!readHandshake(&in, MSG_WELCOME, &version, &caps)) {
+        if (version) {
+            fprintf(stderr, "kdialogd5 speaks protocol version %u, we speak %d\n", version, KGTK_PROTOCOL_VERSION);
+        } else {
+            fprintf(stderr, "kdialogd5 did not reply\n");
+        }
+    } else if (!readFrame(&in, &header, &payload) || MSG_STATS_REPLY != header.type) {
+        fprintf(stderr, "kdialogd5 did not send its stats\n");
+    } else {
+        FieldIter it;
+        Field     f;
+
+        initFieldIter(&it, payload.data, payload.len);
+
+        while (nextField(&it, &f) > 0) {
+            if (FIELD_STATS == f.tag && fieldIsString(&f)) {
+                fwrite(f.data, 1, f.length, stdout);
+                rv = 0;
+            }
+        }
+    }
+
+    freeBuffer(&request);
+    freeBuffer(&payload);
+    freeReadBuffer(&in);
+    ::close(fd);
+    return rv;
+}
+
+// Each app that may show a dialog keeps a connection to us, and the usual soft limit of 1024 fds would have us
+// turning them away once there are about a thousand - so go up to the hard limit, as the I/O thread uses epoll,
+// and not select(), and so is not limited by FD_SETSIZE
+static void raiseFdLimit()
+{
+    struct rlimit limit;
+
+    if (0 == getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max) {
+        rlim_t soft = limit.rlim_cur;
+
+        limit.rlim_cur = limit.rlim_max;
+
+        if (0 != setrlimit(RLIMIT_NOFILE, &limit)) {
+            qCWarning(kdialogd) << "Could not raise the fd limit from" << (quint64)soft << "-" << strerror(errno);
+        }
+    }
+}
+
 int main(int argc, char **argv)
 {
+    if (argc >= 2 && 0 == strcmp(argv[1], "--launch")) {
+        return launch(3 == argc && 0 == strncmp(argv[2], "--ready-fd=", 11) ? atoi(argv[2] + 11) : -1);
+    }
+
+    if (2 == argc && 0 == strcmp(argv[1], "--stats")) {
+        return printStats();
+    }
+
     QApplication app(argc, argv);
     app.setQuitOnLastWindowClosed(false);
 
@@ -863,6 +3214,8 @@ int main(int argc, char **argv)
 
     KAboutData::setApplicationData(about);
     QCommandLineParser parser;
+    parser.addOption(QCommandLineOption("launch", i18n("Bind the socket, start the daemon in the background, and exit.")));
+    parser.addOption(QCommandLineOption("stats", i18n("Print the running daemon's statistics, and exit.")));
     about.setupCommandLine(&parser);
     parser.process(app);
 
@@ -880,9 +3233,17 @@ int main(int argc, char **argv)
 
     KDBusService service(KDBusService::Unique);
     // get here only if the first instance of the daemon
-    KDialogD kdialogd;
-    int rv = app.exec();
-    unlink(getSockName());
+    int rv;
+
+    raiseFdLimit();
+
+    {
+        KDialogD kdialogd;
+
+        rv = app.exec();
+    }
+
+    // Only release the lock once the socket has been closed
     releaseLock();
     return rv;
 }
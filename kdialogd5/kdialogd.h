@@ -1,46 +1,328 @@
 #ifndef __KDIALOGD_H__
 #define __KDIALOGD_H__
 
+#include <QAtomicInt>
+#include <QElapsedTimer>
 #include <QFileDialog>
+#include <QHash>
 #include <QLoggingCategory>
 #include <QMap>
-
-#include "common.h"
+#include <QMutex>
+#include <QPointer>
+#include <QSet>
+#include <QSharedPointer>
+#include <QThread>
+#include <QVariant>
+#include <QVector>
+#include <QWaitCondition>
+
+#include "proto.h"
 #include "config.h"
 
 
-#ifdef KDIALOGD_APP
-class QTimer;
-#else
+#ifndef KDIALOGD_APP
 #include <kdedmodule.h>
 #endif
+class QTimer;
 class KDialog;
 class KConfig;
+class KCoreDirLister;
+class KJob;
+
+// A MSG_OPEN request, as decoded by the I/O thread
+struct KDialogDRequest {
+    uint32_t     id;
+    Operation    op;
+    unsigned int xid;
+    QString      caption,
+                 startDir,
+                 filter,
+                 customWidgets;
+    bool         overWrite;
+    QElapsedTimer received;     // Started as the I/O thread read it
+    QByteArray   traceId;       // Correlation id, if the app is tracing
+    quint64      traceReceived; // traceNow() as the I/O thread read it
+};
+
+Q_DECLARE_METATYPE(KDialogDRequest)
+
+// Owns the listening socket, and every client connection, and does all of their I/O - without blocking - on a
+// thread of its own, so that a slow or stalled client can never hold up the dialogs. Only complete, decoded,
+// requests are passed on to the GUI thread. Connections are identified by an id, and not their fd, as fds
+// are reused.
+//
+// Many apps connect, and then never show a dialog - so an idle connection is just an entry in our table, and
+// the GUI thread only hears about a connection once it has sent a request.
+class KDialogDIo : public QThread
+{
+    Q_OBJECT
+
+public:
+
+    KDialogDIo(int listenFd, QObject *parent);
+    virtual ~KDialogDIo();
+
+    // These may be called from any thread. send() takes the frame's data, and passFd, even if it fails - and if
+    // 'notify' is set, written() is emitted once the frame has all been written
+    bool send(int conn, Buffer *frame, int passFd = -1, bool notify = false);
+    void closeConnection(int conn);
+    void stop();
+
+    // Connections with no dialogs open for this long are closed - 0 never closes them. Set before start()
+    void setIdleTimeout(int secs)
+    {
+        itsIdleTimeout = secs * 1000;
+    }
+
+    // Accepted connections, including those that are still handshaking
+    int connections() const
+    {
+        return itsConnectionCount.load();
+    }
+
+signals:
+
+    void connectionsChanged(bool any);  // Emitted when the first connection is made, and when the last goes
+    void request(int conn, const QString &appName, uint32_t caps, const KDialogDRequest &req);
+    void cancelled(int conn, uint32_t id);
+    void disconnected(int conn);
+    void statsRequested(int conn, uint32_t id, const QString &ioStats);  // ioStats holds our own counters
+    void written(int conn);
+
+protected:
+
+    void run() override;
+
+private:
+
+    enum State {
+        STATE_APP_NAME,
+        STATE_HELLO,
+        STATE_READY,
+        STATE_CLOSING   // Flushing the output, and then closing
+    };
+
+    struct Output {
+        Buffer data;
+        size_t sent;
+        int    passFd;
+        bool   notify;  // Emit written() once it has all gone
+    };
+
+    struct Connection {
+        int           id,
+                      fd;
+        State         state;
+        ReadBuffer    in;
+        Buffer        payload;
+        QString       appName;
+        uint32_t      caps;
+        QList<Output> out;
+        uint32_t      events;     // As registered with epoll
+        bool          announced;  // Has had requests passed to the GUI thread
+        int           pending;    // Requests that have not yet been sent their result
+        qint64        lastActive;
+        size_t        queued;     // Bytes of output not yet written
+    };
+
+    struct Command {
+        int    conn;
+        bool   close;
+        Output output;
+    };
+
+    // How connection bursts were handled
+    struct AcceptStats {
+        unsigned int accepted,
+                     rejected,      // Not from our user
+                     refused,       // Closed at once, as we had run out of fds
+                     fullBursts,    // Wakeups that accepted a whole backlog - others may have been kept waiting
+                     largestBurst;
+    };
+
+    // Frames, and connections, that were refused as they broke our limits
+    struct RejectStats {
+        unsigned int oversized,     // App name, frame, or field longer than allowed
+                     malformed,
+                     unexpected,    // A message that is not valid in the connection's state
+                     busy,          // Requests refused, as their connection had too many open
+                     overBudget;    // Connections that held too much buffered data
+    };
+
+    struct TrafficStats {
+        quint64 bytesRead,
+                bytesWritten;
+    };
+
+    void accept();
+    bool addConnection(int fd);
+    void wake();
+    void runCommands();
+    void readConnection(Connection *c);
+    bool handleFrames(Connection *c);
+    bool queue(Connection *c, const Output &output);
+    bool flush(Connection *c);
+    void updateEvents(Connection *c);
+    void drop(Connection *c, bool notify = true);
+    void closeIdle();
+    QString statsReport() const;
+
+private:
+
+    int                      itsListenFd,
+                             itsEpollFd,
+                             itsWakeFd,
+                             itsSpareFd,        // Given up to accept, and close, a connection when out of fds
+                             itsNextId,
+                             itsIdleTimeout;    // ms
+    qint64                   itsNextIdleCheck;
+    QElapsedTimer            itsClock;
+    QAtomicInt               itsConnectionCount;
+    QHash<int, Connection *> itsConnections;    // Only touched by the I/O thread
+    AcceptStats              itsAcceptStats;    // ...as are these
+    RejectStats              itsRejectStats;
+    TrafficStats             itsTrafficStats;
+
+    QMutex                   itsMutex;          // Guards the following
+    QList<Command>           itsCommands;
+    bool                     itsStop;
+};
+
+// Converts a selection to local paths without blocking, or running a nested event loop - urls that are not
+// already local are resolved by up to RESOLVE_MAX_JOBS KIO::mostLocalUrl jobs at once. Paths are passed on in
+// the order of the urls, via resolved() if batched, and finished() is emitted once all are resolved, or one
+// turns out not to be local, or kill() is called.
+class KDialogDUrlResolver : public QObject
+{
+    Q_OBJECT
+
+public:
+
+    KDialogDUrlResolver(const QList<QUrl> &urls, QWidget *window, bool batched, QObject *parent);
+    virtual ~KDialogDUrlResolver();
+
+    void start();
+    void kill();
 
+    // The paths that have not been passed on via resolved() - after finished(), the last of them
+    QStringList takeItems();
+
+    static void clearResolvedDirs();
+
+signals:
+
+    void resolved(const QStringList &items);
+    void finished(bool ok);
+
+private slots:
+
+    void jobResult(KJob *job);
+
+private:
+
+    // Where a remote folder was last found to be mounted, e.g. by kio-fuse
+    struct ResolvedDir {
+        QUrl          dir;
+        QString       path;
+        QElapsedTimer age;
+    };
+
+    bool fromCache(int index);
+    void startJobs();
+    void passOn();
+    void finish(bool ok);
+    void killJobs();
+
+private:
+
+    QList<QUrl>        itsUrls;
+    QVector<QString>   itsPaths;        // Null until resolved
+    QPointer<QWidget>  itsWindow;
+    bool               itsBatched,
+                       itsFinished;
+    int                itsNext,         // Next url to resolve
+                       itsDone;         // Next path to pass on
+    QHash<KJob *, int> itsJobs;         // Running jobs, and the index of the url that each resolves
+    QStringList        itsItems;
+    QElapsedTimer      itsTimer,
+                       itsStarted;
+    quint64            itsTraceStart;
+    bool               itsUsedKio;
+
+    static QList<ResolvedDir> theirResolvedDirs;    // Most recent first
+};
+
+// A request's filters, translated from KDE's "patterns|name" lines for QFileDialog
+struct KDialogDFilters {
+    QString                 raw;            // As the client sent them
+    QStringList             nameFilters;    // "name (patterns)"
+    QHash<QString, QString> kdeFilters;     // Each of nameFilters, as QFileDialog reports it, to its raw line
+};
+
+typedef QSharedPointer<const KDialogDFilters> KDialogDFiltersPtr;
+
+// Apps send the same filters - often hundreds of them - with every dialog, so recent translations are kept
+class KDialogDFilterCache
+{
+public:
+
+    KDialogDFiltersPtr get(const QString &appName, const QString &raw);
+    void clear();
+
+private:
+
+    static KDialogDFiltersPtr translate(const QString &raw);
+
+private:
+
+    struct Entry {
+        QString            appName;
+        uint               hash;            // Of the raw filters
+        KDialogDFiltersPtr filters;
+    };
+
+    QList<Entry> itsEntries;                // Most recently used first
+};
+
+// Dialogs are built once, and then set up for each request that they are used for - see KDialogDPool
 class KDialogDFileDialog : public QFileDialog
 {
     Q_OBJECT
 
 public:
 
-    KDialogDFileDialog(QString &an, Operation op, const QString &startDir, const QString &filter,
-                       const QString &customWidgets, bool confirmOw);
+    KDialogDFileDialog();
     virtual ~KDialogDFileDialog();
 
+    void setup(const QString &an, Operation op, const QString &startDir, const KDialogDFiltersPtr &filters,
+               const QString &customWidgets, bool confirmOw);
+    void saveConfig();
+
 public slots:
 
     void accept() override;
+    void abort();
 
 signals:
 
-    void ok(const QStringList &items);
+    void resolved(const QStringList &items);
+    void ok(const QStringList &items, const QString &selectedFilter, const QString &customWidgets);
+
+private slots:
+
+    void resolveFinished(bool good);
 
 private:
 
-    bool                     itsConfirmOw,
-                             itsDone;
-    QString                  &itsAppName;
-    QMap<QString, QWidget *> itsCustom;
+    bool                          itsConfirmOw,
+                                  itsBusy,       // Accepted - resolving, or confirming, the selection
+                                  itsAborted;
+    QString                       itsAppName;
+    KDialogDFiltersPtr            itsFilters;
+    QWidget                       *itsCustomWidget;
+    QMap<QString, QWidget *>      itsCustom;
+    QPointer<KDialogDUrlResolver> itsResolver;
+    QPointer<KJob>                itsJob;        // KIO job that we are waiting on
 };
 
 class KDialogDDirSelectDialog : public QFileDialog
@@ -49,67 +331,241 @@ class KDialogDDirSelectDialog : public QFileDialog
 
 public:
 
-    KDialogDDirSelectDialog(QString &an, const QString &startDir = QString(),
-                            bool localOnly = false,  QWidget *parent = 0L);
+    KDialogDDirSelectDialog();
     virtual ~KDialogDDirSelectDialog();
 
+    void setup(const QString &an, const QString &startDir = QString(), bool localOnly = false);
+    void saveConfig();
+
 public slots:
 
     void slotOk();
+    void abort();
 
 signals:
 
-    void ok(const QStringList &items);
+    void resolved(const QStringList &items);
+    void ok(const QStringList &items, const QString &selectedFilter, const QString &customWidgets);
+
+private slots:
+
+    void resolveFinished(bool good);
 
 private:
 
-    QString &itsAppName;
+    bool                          itsBusy,
+                                  itsAborted;
+    QString                       itsAppName;
+    QPointer<KDialogDUrlResolver> itsResolver;
 };
 
+// Hidden dialogs, built ahead of time - constructing a QFileDialog, with KDE's file widget, places model, and
+// icons, is most of the time taken to show one. Dialogs are handed out set up for a request, and come back to
+// be reused once it is done with. The pool is filled after startup, and whilst no dialogs are open.
+class KDialogDPool : public QObject
+{
+    Q_OBJECT
+
+public:
+
+    KDialogDPool(int size, QObject *parent);
+    virtual ~KDialogDPool();
+
+    KDialogDFileDialog *fileDialog();
+    KDialogDDirSelectDialog *dirSelectDialog();
+
+    // Call instead of deleting a dialog - it is reset, or deleted, once control returns to the event loop
+    void release(QDialog *dlg);
+
+    // Delete the dialogs that are not in use - the pool is filled again once a dialog is next released
+    void drain();
+
+private slots:
+
+    void fill();
+    void recycle();
+
+private:
+
+    void scheduleFill();
+
+private:
+
+    int                                 itsSize,       // Dialogs kept, of each type
+                                        itsInUse;
+    QList<KDialogDFileDialog *>         itsFileDialogs;
+    QList<KDialogDDirSelectDialog *>    itsDirSelectDialogs;
+    QList<QPointer<QDialog> >           itsReleased;
+    QTimer                              *itsFillTimer;
+};
+
+// Folders that our dialogs have recently shown, kept listed. KIO shares listings between all of the dialogs in
+// this process, and keeps those that are in use up to date via KDirWatch (inotify) - so a dialog that opens one
+// of these again, for any app, is filled at once instead of listing it. Bounded by the number of items held,
+// dropping the least recently used folders first.
+class KDialogDDirCache : public QObject
+{
+    Q_OBJECT
+
+public:
+
+    KDialogDDirCache(int maxItems, QObject *parent);
+    virtual ~KDialogDDirCache();
+
+    void use(const QUrl &dir);
+    void clear();
+
+private slots:
+
+    void trim();
+
+private:
+
+    int                     itsMaxItems;
+    QList<KCoreDirLister *> itsListers;     // Most recently used first
+};
+
+// The dialogs that a connection has open - this only exists whilst it has some
 class KDialogDClient : public QObject
 {
     Q_OBJECT
 
 public:
 
-    KDialogDClient(int sock, const QString &an, QObject *parent);
+    KDialogDClient(KDialogDIo *io, int conn, const QString &an, uint32_t caps, QObject *parent);
     virtual ~KDialogDClient();
 
+    void request(const KDialogDRequest &req);
+    void cancel(uint32_t id);
+    void written();
+
 public slots:
 
-    void read();
     void close();
-    void ok(const QStringList &items);
+    void resolved(const QStringList &items);
+    void ok(const QStringList &items, const QString &selectedFilter, const QString &customWidgets);
     void finished();
 
 signals:
 
     void error(KDialogDClient *);
+    void idle(KDialogDClient *);
 
 private:
 
-    void cancel();
-    bool readData(QByteArray &buffer, int size);
-    bool readData(char *buffer, int size)
-    {
-        return readBlock(itsFd, buffer, size);
-    }
-    bool writeData(const char *buffer, int size)
-    {
-        return writeBlock(itsFd, buffer, size);
-    }
-    bool readString(QString &str);
-    bool writeString(const QString &str);
-    void initDialog(const QString &caption, QDialog *d);
+    struct Request {
+        QDialog       *dlg;
+        unsigned int  xid;
+        QStringList   items;    // Resolved items held back from a client that cannot take partial results
+        QElapsedTimer received;
+        qint64        shown;    // ms after it was received
+        QByteArray    traceId;
+        quint64       traceShown;
+    };
+
+    // Paths, and then maybe the result, still to be sent for a request
+    struct Reply {
+        uint32_t    id;
+        QStringList items;
+        int         next;       // First item not yet sent
+        bool        result,     // Send the result once the items have gone
+                    accepted;
+        QString     selectedFilter,
+                    customWidgets;
+        QByteArray  traceId;
+    };
+
+    int addPaths(Buffer *response, const QStringList &items, int &next) const;
+    Reply &queuedReply(uint32_t id);
+    bool sendPart(uint32_t id, const QStringList &items);
+    bool sendResult(uint32_t id, const QByteArray &traceId, bool accepted, const QStringList &items = QStringList(),
+                    const QString &selectedFilter = QString(), const QString &customWidgets = QString());
+    bool sendReplies();
+    bool isIdle() const;
+    void initDialog(const KDialogDRequest &r, const QString &caption, QDialog *d);
+    void answered(const Request &req, bool accepted);
+    uint32_t requestId(const QObject *dlg) const;
     bool eventFilter(QObject *object, QEvent *event) override;
 
 private:
 
-    int          itsFd;
-    QDialog      *itsDlg;
-    unsigned int itsXid;
-    bool         itsAccepted;
-    QString      itsAppName;
+    KDialogDIo              *itsIo;
+    int                     itsConn;
+    uint32_t                itsCaps;
+    QMap<uint32_t, Request> itsRequests;    // Open dialogs, keyed on the client's request id
+    QList<Reply>            itsReplies;     // Waiting to be sent, in order
+    QSet<uint32_t>          itsFailed;      // Requests whose paths could not be sent, so are answered as cancelled
+    bool                    itsWriting;     // A frame is with the I/O thread, the next waits for it to be written
+    QString                 itsAppName;
+};
+
+// Writes our settings to disk on a thread of its own, so that the GUI thread never waits on the disk. Changes
+// are batched up until none have been made for a little while, so that a burst of them - e.g. as many apps
+// close at logout - is written just once. KConfig writes the file atomically.
+class KDialogDConfigWriter : public QThread
+{
+    Q_OBJECT
+
+public:
+
+    KDialogDConfigWriter(const QString &fileName, QObject *parent);
+    virtual ~KDialogDConfigWriter();    // Writes anything still pending
+
+    void writeEntry(const QString &group, const char *key, const QVariant &value);
+
+protected:
+
+    void run() override;
+
+private:
+
+    QString                                     itsFileName;
+    QMutex                                      itsMutex;       // Guards the following
+    QWaitCondition                              itsChanged;
+    QMap<QString, QMap<QByteArray, QVariant> >  itsPending;     // Keyed on group, and then key
+    bool                                        itsStop;
+};
+
+// Latencies, counted in buckets of up to 10ms, 30ms, 100ms, and so on up to 100s - and longer
+class KDialogDHistogram
+{
+public:
+
+    KDialogDHistogram();
+
+    void add(qint64 ms);
+    QString report(const QString &name) const;
+
+private:
+
+    enum { BUCKETS = 10 };
+
+    quint64 itsCounts[BUCKETS],
+            itsCount;
+    qint64  itsSum;
+};
+
+// What the GUI thread has done, for `kdialogd5 --stats` - the I/O thread counts its own
+struct KDialogDStats {
+    struct Cache {
+        quint64 hits,
+                misses;
+    };
+
+    KDialogDStats();
+
+    quint64           requests[OP_FOLDER + 1],  // By Operation
+                      accepted,
+                      cancelled,
+                      paths,                    // Sent in accepted results
+                      shrinks;                  // Times that we shrank when idle, instead of exiting
+    KDialogDHistogram shown,                    // From the I/O thread reading a request, to its dialog showing
+                      answered,                 // ...and from then, to its result being sent
+                      resolved;                 // Selections that needed KIO to find their local paths
+    Cache             pool,
+                      dirCache,
+                      filterCache,
+                      resolvedDirs;             // Remote files found via the mount point of their folder
 };
 
 class KDialogD : public QObject
@@ -123,25 +579,68 @@ public:
 
 public slots:
 
-    void newConnection();
-    void deleteConnection(KDialogDClient *client);
+    void connectionsChanged(bool any);
+    void request(int conn, const QString &appName, uint32_t caps, const KDialogDRequest &req);
+    void cancelled(int conn, uint32_t id);
+    void disconnected(int conn);
+    void deleteClient(KDialogDClient *client);
     void timeout();
+    void statsRequested(int conn, uint32_t id, const QString &ioStats);
+    void written(int conn);
 
     static KConfig *config()
     {
         return theirConfig;
     }
 
+    static KDialogDPool *pool()
+    {
+        return theirPool;
+    }
+
+    static KDialogDDirCache *dirCache()
+    {
+        return theirDirCache;
+    }
+
+    static KDialogDFilterCache *filterCache()
+    {
+        return theirFilterCache;
+    }
+
+    static KDialogDStats &stats()
+    {
+        return theirStats;
+    }
+
+    // Settings are only changed via this - the change is seen by config() at once, and written out later
+    static void writeConfigEntry(const QString &group, const char *key, const QVariant &value);
+
 private:
 
 #ifdef KDIALOGD_APP
-    QTimer *itsTimer;
-    int    itsTimeoutVal;
+    bool shrink();
 #endif
-    int    itsFd,
-           itsNumConnections;
 
-    static KConfig *theirConfig;
+private:
+
+#ifdef KDIALOGD_APP
+    QTimer                      *itsTimer;
+    int                         itsTimeoutVal,
+                                itsIdleTarget;  // MiB to shrink to when idle, instead of exiting - 0 to exit
+#endif
+    bool                        itsAbstract;    // Listening on the abstract socket, and not the filesystem one?
+    int                         itsFd;
+    KDialogDIo                  *itsIo;
+    QHash<int, KDialogDClient *> itsClients;     // Connections with open dialogs, keyed on their id
+    QElapsedTimer               itsUptime;
+
+    static KConfig              *theirConfig;
+    static KDialogDConfigWriter *theirConfigWriter;
+    static KDialogDPool         *theirPool;
+    static KDialogDDirCache     *theirDirCache;
+    static KDialogDFilterCache  *theirFilterCache;
+    static KDialogDStats        theirStats;
 };
 
 #ifndef KDIALOGD_APP
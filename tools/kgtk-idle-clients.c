@@ -0,0 +1,152 @@
+/*
+ * KGtk
+ *
+ * Copyright 2006-2011 Craig Drummond <craig.p.drummond@gmail.com>
+ *
+ * ----
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+    Measure what idle apps cost kdialogd. This connects to kdialogd (starting it if need be) the way libkgtk
+    does, then opens the given number of further connections - each with its handshake done, but no request -
+    and reports kdialogd's resident size before and after, as "kdialogd5 --stats" gives it.
+
+    Usage: kgtk-idle-clients [connections] [seconds to hold them open afterwards]
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <glib.h>
+#include "connect.h"
+
+#define DEFAULT_CONNECTIONS 5000
+
+/* Read one counter from "kdialogd5 --stats". Returns -1 if it could not be read */
+static long long readStat(const char *name)
+{
+    FILE      *stats = popen(KDIALOGD_LOCATION"/kdialogd5 --stats", "r");
+    char      line[512];
+    size_t    len = strlen(name);
+    long long value = -1;
+
+    if (!stats) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), stats)) {
+        if (0 == strncmp(line, name, len) && ' ' == line[len]) {
+            value = atoll(&line[len + 1]);
+        }
+    }
+
+    pclose(stats);
+    return value;
+}
+
+/* Connect, and complete the handshake. Returns the fd, or -1 */
+static int idleConnection()
+{
+    int fd = -1;
+
+    if (connectToKDialogD("kgtk-idle-clients")) {
+        ReadBuffer in;
+
+        /* If we started kdialogd, its WELCOME has not been read yet */
+        initReadBuffer(&in, kdialogdSocket);
+
+        if (readPendingWelcome(&in)) {
+            fd = kdialogdSocket;
+        } else {
+            close(kdialogdSocket);
+        }
+
+        freeReadBuffer(&in);
+    }
+
+    /* Keep the connection, and have the next call make a new one */
+    kdialogdSocket = -1;
+    return fd;
+}
+
+int main(int argc, char **argv)
+{
+    int           count = argc > 1 ? atoi(argv[1]) : DEFAULT_CONNECTIONS,
+                  hold = argc > 2 ? atoi(argv[2]) : 0,
+                  first,
+                  opened = 0,
+                  i;
+    long long     before,
+                  after,
+                  connections;
+    struct rlimit limit;
+
+    if (count <= 0) {
+        fprintf(stderr, "Usage: %s [connections] [seconds to hold them open]\n", argv[0]);
+        return 1;
+    }
+
+    /* One fd per connection, plus a few for us */
+    if (0 == getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (-1 == (first = idleConnection())) {
+        fprintf(stderr, "Could not connect to kdialogd5\n");
+        return 1;
+    }
+
+    before = readStat("kdialogd_rss_bytes");
+
+    for (i = 0; i < count; ++i) {
+        if (-1 == idleConnection()) {
+            fprintf(stderr, "Could only open %d connections - %s\n", opened, strerror(errno));
+            break;
+        }
+
+        opened++;
+    }
+
+    after = readStat("kdialogd_rss_bytes");
+    connections = readStat("kdialogd_connections");
+
+    if (before < 0 || after < 0) {
+        fprintf(stderr, "Could not read kdialogd5's statistics\n");
+        return 1;
+    }
+
+    printf("idle connections       %d\n", opened);
+    printf("kdialogd connections   %lld\n", connections);
+    printf("kdialogd rss before    %lld KiB\n", before / 1024);
+    printf("kdialogd rss after     %lld KiB\n", after / 1024);
+
+    if (opened) {
+        printf("per connection         %lld bytes\n", (after - before) / opened);
+    }
+
+    if (hold > 0) {
+        sleep(hold);
+    }
+
+    /* Exiting closes the connections */
+    close(first);
+    return 0;
+}